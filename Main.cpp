@@ -9,6 +9,91 @@
 */
 bool isFile;
 
+/*
+    options holds the settings given on the command line with -- options.
+    They apply to every command the shell runs
+*/
+shellOptions options;
+
+/*
+    state of the --journal option. journalFd is the open journal, -1 when
+    there is none. completedLines maps the byte offset of every line found in
+    the journal on --resume to the hash of its content. environmentChanges
+    holds the variables set since the last record was written. Function
+    bodies run by the job pool workers set variables too, so the assignments
+    and environmentChanges are taken under environmentLock
+*/
+int journalFd = -1;
+map<long long, unsigned long long> completedLines;
+vector<string> environmentChanges;
+mutex environmentLock;
+
+/*
+    functions maps the name of every defined function to its body, parsed once
+    when the definition is read. positionalArguments holds the arguments of
+    the function calls in progress, the innermost call last. Functions are
+    also called by the workers of parallel and batch-args, so every thread has
+    its own calls
+*/
+map<string, vector<executionPlan>> functions;
+thread_local vector<vector<string>> positionalArguments;
+
+/*
+    stdoutOverrideFd is where commands without a redirection write while the
+    output of a $(...) command is captured, or while a function body runs with
+    its output redirected, -1 otherwise. stdinOverrideFd is where commands
+    without a redirection read while a function body runs with its input
+    redirected. Both are per thread, like the function calls
+*/
+thread_local int stdoutOverrideFd = -1;
+thread_local int stdinOverrideFd = -1;
+
+/*
+    stageDeadlineMs is the deadline, in milliseconds of the steady clock, of
+    the parallel, batch-args or function call the thread runs for, 0 for none.
+    Every command the builtin starts is killed by then and none starts after
+*/
+thread_local long long stageDeadlineMs = 0;
+
+/*
+    the queue and the thread of --parse-ahead while a script runs, so a line
+    that exits the shell can stop the parser before the globals it reads are
+    destroyed
+*/
+planQueue *parserQueue = nullptr;
+thread *parserThread = nullptr;
+
+/*
+    timedOutCount is the number of commands killed at their deadline, it is
+    reported when a script ends. The job pool workers wait on their children
+    too, so it is atomic
+*/
+atomic<size_t> timedOutCount{0};
+
+/*
+    state of --record and --replay. recordFd is the open log, -1 when there is
+    none. currentRecord is the line being recorded, its children are added by
+    the threads that wait on them under recordLock. recordedEnvironment is the
+    environment at the last recorded line, only the changes are logged.
+    sessionStart is when the recording or the replay started. replayStubs holds
+    the recorded children of the line being replayed with --stub-children
+*/
+int recordFd = -1;
+recordedLine currentRecord;
+mutex recordLock;
+map<string, string> recordedEnvironment;
+string recordedCwd;
+chrono::steady_clock::time_point sessionStart;
+vector<recordedChild> replayStubs;
+
+/*
+    peakRss maps every command run with --mem-budget to the highest RSS seen
+    for it, in bytes, the estimate of its next launch. Jobs are waited on from
+    several threads so it is updated under peakLock
+*/
+map<string, size_t> peakRss;
+mutex peakLock;
+
 /**
  * @brief The main function for Mish Shell.
  *
@@ -16,8 +101,9 @@ bool isFile;
  * only be run in. Two states, interactive or interactive. It determines
  * whether the shell should run in interactive mode or execute a script
  * based on the command line arguments.
- * If the number of arguments is greater than 2 then it's an error.
- *  If it is in non-interective, then argv[1] is the name of the script file
+ * Arguments starting with -- are options (see parseOptions), if more than one
+ * other argument is given then it's an error.
+ *  If it is in non-interective, then that argument is the name of the script file
  *
  * @param argc The number of command line arguments.
  * @param argv An array of strings representing the command line arguments.
@@ -27,8 +113,31 @@ bool isFile;
 
 int main(int argc, char *argv[])
 {
-    // Check if arguments were passed to the shell to run commands from a file
-    if (argc == 1)
+    // name of the script file, stays empty in interactive mode
+    string scriptName;
+    // a command that stops reading must not kill the shell while it feeds it
+    // decompressed input, children get the default back before exec
+    signal(SIGPIPE, SIG_IGN);
+    // read the options and the script file from the arguments
+    if (!parseOptions(argc, argv, scriptName))
+    {
+        // Invalid arguments so print an error and exit
+        perror("Invalid arguments");
+        exit(0);
+    }
+    // a replay runs the lines of the log instead of a script or the prompt
+    if (!options.replayFile.empty())
+    {
+        runReplay();
+        return 0;
+    }
+    if (!options.recordFile.empty())
+    {
+        openRecord();
+    }
+
+    // Check if a script was passed to the shell to run commands from a file
+    if (scriptName.empty())
     {
         // If no arguments were passed. Running in interactive mode
         cout << "*******************************************" << endl;
@@ -37,20 +146,14 @@ int main(int argc, char *argv[])
 
         interactive();
     }
-    else if (argc == 2)
+    else
     {
-        // If 1 argument was passed. Running in non-interactive mode with a
-        //script. where argv[1] is the the name of the script file
+        // If a script was passed. Running in non-interactive mode with a
+        //script. where scriptName is the the name of the script file
         cout << "**************************************************" << endl;
         cout << "WELCOME TO MISH SHELL. YOUR SCRIPT IS RUNNING" << endl;
         cout << "**************************************************" << endl;
-        nonInteractive(argv[1]);
-    }
-    else if (argc > 2)
-    {
-        // Invalid number of arguments so print an error and exit
-        perror("Invalid arguments");
-        exit(0);
+        nonInteractive(scriptName);
     }
 
     // Exit the program
@@ -58,6 +161,184 @@ int main(int argc, char *argv[])
 }
 
 
+/**
+ * @brief Reads the command line arguments of the shell.
+ *
+ * Supported options:
+ * - --group-output line|job  collects the output of parallel (&) commands and
+ *   writes it a whole line or a whole command at a time
+ * - --journal FILE  records every completed line of a script in FILE
+ * - --resume  skips the lines already recorded in the journal
+ * - --explain  prints the plan of every line before and after optimizing it
+ * - --no-optimize  runs pipelines exactly as written
+ * - --parse-ahead N  parses up to N script lines ahead of the running one (64
+ *   by default, 0 turns it off)
+ * - --subst-limit BYTES  the most output a $(...) command may give (16 MiB by
+ *   default, K, M and G suffixes are allowed)
+ * - --line-timeout DUR  the longest every command of a line may run
+ * - --kill-after DUR  the time from SIGTERM to SIGKILL for a command past its
+ *   deadline (2s by default)
+ * - --record FILE  logs every line with its timing and children to FILE
+ * - --replay FILE  runs the lines of a log with their recorded timing
+ * - --speed X  replays X times faster than recorded
+ * - --stub-children  replays the children as sleeps of their recorded duration
+ * - --mem-budget BYTES  delays the jobs of a & line while their memory would
+ *   go over BYTES (K, M and G suffixes are allowed)
+ *
+ * @param argc The number of command line arguments.
+ * @param argv An array of strings representing the command line arguments.
+ * @param scriptName Updated with the script file, if one was given.
+ * @return Returns false if an option or the number of arguments is invalid.
+ */
+bool parseOptions(int argc, char *argv[], string &scriptName)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string argument = argv[i];
+        if (argument == "--group-output")
+        {
+            // the mode is the next argument
+            if (i + 1 >= argc)
+            {
+                return false;
+            }
+            options.groupOutput = argv[++i];
+            if (options.groupOutput != "line" && options.groupOutput != "job")
+            {
+                return false;
+            }
+        }
+        else if (argument == "--journal")
+        {
+            // the journal file is the next argument
+            if (i + 1 >= argc)
+            {
+                return false;
+            }
+            options.journalFile = argv[++i];
+        }
+        else if (argument == "--resume")
+        {
+            options.resume = true;
+        }
+        else if (argument == "--explain")
+        {
+            options.explain = true;
+        }
+        else if (argument == "--no-optimize")
+        {
+            options.optimize = false;
+        }
+        else if (argument == "--parse-ahead")
+        {
+            // the depth is the next argument, 0 is allowed
+            if (i + 1 >= argc)
+            {
+                return false;
+            }
+            string depth = argv[++i];
+            if (depth != "0" && !parseCount(depth, options.parseAhead))
+            {
+                return false;
+            }
+            if (depth == "0")
+            {
+                options.parseAhead = 0;
+            }
+        }
+        else if (argument == "--subst-limit")
+        {
+            if (i + 1 >= argc || !parseBytes(argv[++i], options.substitutionLimit))
+            {
+                return false;
+            }
+        }
+        else if (argument == "--line-timeout")
+        {
+            if (i + 1 >= argc || !parseDuration(argv[++i], options.lineTimeoutMs))
+            {
+                return false;
+            }
+        }
+        else if (argument == "--kill-after")
+        {
+            if (i + 1 >= argc || !parseDuration(argv[++i], options.killAfterMs))
+            {
+                return false;
+            }
+        }
+        else if (argument == "--record")
+        {
+            if (i + 1 >= argc)
+            {
+                return false;
+            }
+            options.recordFile = argv[++i];
+        }
+        else if (argument == "--replay")
+        {
+            if (i + 1 >= argc)
+            {
+                return false;
+            }
+            options.replayFile = argv[++i];
+        }
+        else if (argument == "--speed")
+        {
+            if (i + 1 >= argc)
+            {
+                return false;
+            }
+            char *end;
+            options.replaySpeed = strtod(argv[++i], &end);
+            if (*end != '\0' || !(options.replaySpeed > 0))
+            {
+                return false;
+            }
+        }
+        else if (argument == "--stub-children")
+        {
+            options.stubChildren = true;
+        }
+        else if (argument == "--mem-budget")
+        {
+            if (i + 1 >= argc || !parseBytes(argv[++i], options.memBudget))
+            {
+                return false;
+            }
+        }
+        else if (argument.rfind("--", 0) == 0)
+        {
+            // unknown option
+            return false;
+        }
+        else if (scriptName.empty())
+        {
+            scriptName = argument;
+        }
+        else
+        {
+            // only one script can be run
+            return false;
+        }
+    }
+    // there is nothing to resume from without a journal
+    if (options.resume && options.journalFile.empty())
+    {
+        return false;
+    }
+    // a replay reads its lines from the log only
+    if (!options.replayFile.empty() && (!scriptName.empty() || !options.recordFile.empty()))
+    {
+        return false;
+    }
+    if (options.replayFile.empty() && (options.replaySpeed != 1 || options.stubChildren))
+    {
+        return false;
+    }
+    return true;
+}
+
 
 /**
  * @brief Prints the current working directory as a prompt.
@@ -99,6 +380,10 @@ void interactive() {
             printPrompt();
             continue;
         }
+        // a function definition may go on until a line with }
+        if (opensFunction(input)) {
+            input = readFunctionBody(cin, input, true);
+        }
 
 
         /* Process the user input
@@ -107,7 +392,15 @@ void interactive() {
          * to process the input from the user. It handles parallel
          * and pipe commands as well.
          */
-        processInput(input);
+        if (recordFd != -1)
+        {
+            beginRecordedLine(input);
+        }
+        int status = processInput(input);
+        if (recordFd != -1)
+        {
+            endRecordedLine(status);
+        }
 
         // Display prompt for the next input
         printPrompt();
@@ -121,6 +414,9 @@ void interactive() {
  * This function reads input from a specified file, processes each line using
  * the processInput() function, and then exits. It is intended for batch processing
  * of commands stored in a file. It also updates the isFile variable to true
+ * With --journal every completed line is recorded, with --resume the lines
+ * recorded by an earlier run are skipped. With --parse-ahead a thread parses
+ * the next lines while the current one runs.
  *
  * @param fileName The name of the input file to be processed.
  */
@@ -139,22 +435,114 @@ void nonInteractive(string fileName)
         perror("unable to open input file");
         exit(0);
     }
+    // open the journal, restoring the state of the earlier run on --resume
+    if (!options.journalFile.empty())
+    {
+        openJournal();
+    }
 
-    string input;
-    // Read each line from the input file and process using processInput()
-    while (getline(fin, input)) {
-        if (input.empty()) {
-            continue;
+    // byte offset of the next line
+    long long offset = fin.tellg();
+    // Reads the next line to run from the input file and parses it, returns
+    // false at the end of the file
+    auto readPlan = [&](executionPlan &plan)
+    {
+        string input;
+        while (getline(fin, input)) {
+            long long lineOffset = offset;
+            offset = fin.tellg();
+            if (input.empty()) {
+                continue;
+            }
+            // a function definition may go on until a line with }, it is
+            // handled as one line starting at its first line
+            if (opensFunction(input)) {
+                input = readFunctionBody(fin, input, false);
+                offset = fin.tellg();
+            }
+            // skip the lines an earlier run completed, unless they changed
+            // since. Function definitions always run again, the function
+            // table is not journaled like the directory and variables are
+            string name;
+            string rest;
+            if (options.resume && !parseFunctionHeader(input, name, rest))
+            {
+                map<long long, unsigned long long>::iterator completed = completedLines.find(lineOffset);
+                if (completed != completedLines.end() && completed->second == hashLine(input))
+                {
+                    continue;
+                }
+            }
+            plan = executionPlan();
+            plan.offset = lineOffset;
+            plan.line = input;
+            /* Parse the user input
+             * This function calls other functions like
+             * reduceSpacesAndTrim and generateTokens to split the input
+             * into commands. It handles parallel and pipe commands as well.
+             */
+            parseInput(input, plan);
+            return true;
         }
+        return false;
+    };
+    // Runs a parsed line, errors in a script exit before it is recorded
+    auto run = [&](executionPlan &plan)
+    {
+        if (recordFd != -1)
+        {
+            beginRecordedLine(plan.line);
+        }
+        int status = runPlan(plan);
+        if (recordFd != -1)
+        {
+            endRecordedLine(status);
+        }
+        if (journalFd != -1)
+        {
+            writeJournalRecord(plan.offset, plan.line, status);
+        }
+    };
 
-
-        /* Process the user input
-         * This function calls other functions like
-         * reduceSpacesAndTrim, generateTokens, and executeCommands
-         * to process the input from the user. It handles parallel
-         * and pipe commands as well.
-         */
-        processInput(input);
+    executionPlan plan;
+    if (options.parseAhead == 0)
+    {
+        // parse each line right before running it
+        while (readPlan(plan))
+        {
+            run(plan);
+        }
+    }
+    else
+    {
+        // a parser thread keeps the next lines parsed while a line runs, errors
+        // are still reported in line order since runPlan reports them
+        planQueue queue;
+        queue.slots.resize(options.parseAhead);
+        thread parser([&]()
+        {
+            executionPlan next;
+            while (!queue.stop && readPlan(next))
+            {
+                pushPlan(queue, next);
+            }
+            next = executionPlan();
+            next.endOfInput = true;
+            pushPlan(queue, next);
+        });
+        // exit and the errors of a script call exit() from the lines they run
+        parserQueue = &queue;
+        parserThread = &parser;
+        atexit(stopParser);
+        while (!(plan = popPlan(queue)).endOfInput)
+        {
+            run(plan);
+        }
+        stopParser();
+    }
+    if (timedOutCount > 0)
+    {
+        cerr << timedOutCount << " command(s) timed out" << endl;
     }
     exit(0);
 }
@@ -162,28 +550,51 @@ void nonInteractive(string fileName)
  * @brief Processes an input command.
  *
  * @param input The raw input command to be processed.
+ * @return The exit status of the last command of the line.
+ *
+ * @details This function parses the input with parseInput() and runs the
+ * resulting plan with runPlan().
+ *
+ * @see parseInput()
+ * @see runPlan()
+ */
+int processInput(string input)
+{
+    executionPlan plan;
+    parseInput(input, plan);
+    return runPlan(plan);
+}
+
+
+/**
+ * @brief Parses an input command into an execution plan.
+ *
+ * @param input The raw input command to be processed.
+ * @param plan Updated with the commands of the line, or the syntax error.
  *
  * @details This function takes an input command and processes it to identify
- * individual commands and their parameters. It then executes the commands in
+ * individual commands and their parameters. The commands are marked to run in
  * parallel or sequentially based on the presence of the '&' or '|' symbols.
+ * Parsing has no side effects (nothing is printed or run) so lines can be
+ * parsed ahead of their execution, the errors are reported by runPlan().
  *
  * @note The input command is expected to be a string containing one or more
  *       commands separated by '&' or '|' symbols for parallel or sequential
  *       execution, respectively.
  *
- * @see executeCommands()
+ * @see runPlan()
  *
  * @example
- *   To process a command like "command1 & command2", the input should be:
+ *   To parse a command like "command1 & command2", the input should be:
  *   @code
- *   processInput("command1 & command2");
+ *   parseInput("command1 & command2", plan);
  *   @endcode
  *
  *   The function will identify "command1" and "command2" as separate commands
- *   and execute them in parallel.
+ *   to execute in parallel.
  */
 
-void processInput(string input)
+void parseInput(string input, executionPlan &plan)
 {
     // Initialize variables to keep track of parallel commands, tokens, and file redirections
     // is no parallel commands then basically there is one command so initialize it to 1
@@ -195,10 +606,33 @@ void processInput(string input)
     string redirectedOutputFileName;
     string redirectedInputFileName;
 
+    // on-change holds a whole pipeline after --, so it gets the raw line
+    size_t start = input.find_first_not_of(' ');
+    if (start != string::npos && input.compare(start, 10, "on-change ") == 0)
+    {
+        plan.onChange = input.substr(start);
+        return;
+    }
+    // function definitions are parsed here but only take effect when they run
+    string functionName;
+    string functionRest;
+    if (parseFunctionHeader(input, functionName, functionRest))
+    {
+        parseFunction(functionName, functionRest, plan);
+        return;
+    }
+    // the $(...) commands are parsed now and replaced by placeholders, so their
+    // | & < > are not taken for the operators of the line
+    input = extractSubstitutions(input, plan);
+    if (!plan.error.empty())
+    {
+        return;
+    }
+
     //the reduceSpacesAndTrim function iterates through each character and
     // corrects the input string if there
     // are any errors
-    input = reduceSpacesAndTrim(input);
+    input = reduceSpacesAndTrim(input, plan.error);
 
     //if the input string is empty after reducing spaces and trimming,
     //then ignore it
@@ -206,6 +640,12 @@ void processInput(string input)
     {
         return;
     }
+    //if the command is exit then exit the shell when the line runs
+    if(input=="exit")
+    {
+        plan.isExit = true;
+        return;
+    }
 
     // Iterate through each character in the input string to count the number of parallel commands
     for (size_t i = 0; i < input.size(); i++)
@@ -253,11 +693,7 @@ void processInput(string input)
             // message and exit if it's a file operation
             if (!isLastValid)
             {
-                perror("invalid command \n");
-                if (isFile)
-                {
-                    exit(1);
-                }
+                plan.error = "invalid command \n";
             }
             // Generate tokens and configure properties for the last parallel commands
             generateTokens(input, tokens, redirectedOutputFileName, redirectedInputFileName);
@@ -270,12 +706,15 @@ void processInput(string input)
                 //set output redirection to true
                 commands[i].redirectOutputToFile = true;
                 commands[i].redirectOutputFileName = redirectedOutputFileName;
+                commands[i].outputCompression = compressionFormat(redirectedOutputFileName, input.find(">z ") != string::npos);
             }
             // Check for input redirection and update the command
             if (input.find('<') != string::npos)
             {
                 //update the redirection properties
                 commands[i].redirectedInputFromFile = true;
+                commands[i].redirectedInputFileName = redirectedInputFileName;
+                commands[i].inputCompression = compressionFormat(redirectedInputFileName, input.find("<z ") != string::npos);
             }
             //clear the tokens variable
             tokens.clear();
@@ -317,10 +756,13 @@ void processInput(string input)
         if (tempInput.find('>') != string::npos)
         {
             commands[i].redirectOutputToFile = true;
+            commands[i].outputCompression = compressionFormat(redirectedOutputFileName, tempInput.find(">z ") != string::npos);
         }
         if (tempInput.find('<') != string::npos)
         {
             commands[i].redirectedInputFromFile = true;
+            commands[i].redirectedInputFileName = redirectedInputFileName;
+            commands[i].inputCompression = compressionFormat(redirectedInputFileName, tempInput.find("<z ") != string::npos);
         }
         //update tokens of the command vector
         commands[i].tokens = tokens;
@@ -328,6 +770,82 @@ void processInput(string input)
         commands[i].redirectOutputFileName = redirectedOutputFileName;
         tokens.clear();
     }
+    // a timeout DUR prefix sets the deadline of its command
+    for (int i = 0; i < parallelCommandCount; i++)
+    {
+        parseTimeoutPrefix(commands[i]);
+    }
+    plan.commands = commands;
+}
+
+
+/**
+ * @brief Runs a parsed line.
+ *
+ * Reports the syntax error of the line if there is one, exiting the shell when
+ * running a script, then runs the commands of the line. The pipelines are
+ * optimized right before running so the rewrites see the files as they are then.
+ *
+ * @param plan The plan made by parseInput().
+ * @return The exit status of the last command of the line.
+ */
+int runPlan(executionPlan plan)
+{
+    if (!plan.error.empty())
+    {
+        perror(plan.error.c_str());
+        if (isFile)
+        {
+            exit(1);
+        }
+    }
+    if (plan.isExit)
+    {
+        exit(0);
+    }
+    if (!plan.onChange.empty())
+    {
+        return runOnChange(plan.onChange);
+    }
+    // define the function, a new definition replaces the old one
+    if (!plan.functionName.empty())
+    {
+        functions[plan.functionName] = plan.functionBody;
+        return 0;
+    }
+    if (plan.commands.empty())
+    {
+        return 0;
+    }
+    // run the $(...) commands and put their output in the arguments
+    if (!plan.substitutions.empty() && !expandSubstitutions(plan))
+    {
+        return 1;
+    }
+    // start the <(...) and >(...) commands and pass their pipes as /dev/fd/N
+    vector<thread> processStages;
+    vector<int> processFds;
+    if (!plan.processSubstitutions.empty() && !startProcessSubstitutions(plan, processStages, processFds))
+    {
+        finishProcessSubstitutions(processStages, processFds);
+        return 1;
+    }
+    vector<commandsToExecute> &commands = plan.commands;
+
+    // Rewrite the pipelines to use fewer processes, --explain shows both plans
+    if (options.explain)
+    {
+        cerr << "plan:      " << describePlan(commands) << endl;
+    }
+    if (options.optimize)
+    {
+        optimizePipeline(commands);
+        if (options.explain)
+        {
+            cerr << "optimized: " << describePlan(commands) << endl;
+        }
+    }
+
     // Execute the processed commands
 
     // The executeCommands function is invoked to execute the commands that have
@@ -336,9 +854,9 @@ void processInput(string input)
     // The 'commands' vector serves as the input, providing the set of commands
     // to be executed, which could include both parallel and sequential commands.
 
-    executeCommands(commands);
-    //clear the commands
-    commands.clear();
+    int status = executeCommands(commands);
+    finishProcessSubstitutions(processStages, processFds);
+    return status;
 }
 
 
@@ -354,14 +872,15 @@ void processInput(string input)
  * - Handles invalid parallel commands.
  *
  * @param input The input string to be processed.
+ * @param error Updated with the message of a syntax error, the string returned is then empty.
  * @return A modified string after reducing spaces, trimming, and handling special characters.
  *
  *
- *   string processedInput = reduceSpacesAndTrim("command1 & command2");
+ *   string processedInput = reduceSpacesAndTrim("command1 & command2", error);
  *   @endcode
  *   The resulting 'processedInput' may be "command1 & command2" without extra spaces.
  */
-string reduceSpacesAndTrim(string input)
+string reduceSpacesAndTrim(string input, string &error)
 {
     // Variables
     string result; // The final processed string
@@ -384,11 +903,7 @@ string reduceSpacesAndTrim(string input)
             {
                 if(input[i] == '|' && input[i+1]== ' ' && input[i+2]== '&')
                 {
-                    perror("Invalid input / output redirecting command \n");
-                    if (isFile)
-                    {
-                        exit(1);
-                    }
+                    error = "Invalid input / output redirecting command \n";
                     result ="";
                     return result;
                 }
@@ -398,6 +913,15 @@ string reduceSpacesAndTrim(string input)
                 brokenString.push_back(str);
                 str.clear();
             }
+            // >z and <z are single tokens, they compress the output and
+            // decompress the input
+            if ((input[i] == '>' || input[i] == '<') && i + 1 < input.size() && input[i + 1] == 'z'
+                && (i + 2 == input.size() || input[i + 2] == ' '))
+            {
+                brokenString.push_back(string(1, input[i]) + "z");
+                i++;
+                continue;
+            }
             // Include '&' and '|' as individual tokens
             brokenString.push_back(std::string(1, input[i]));
             //tokenize if there is a space
@@ -430,17 +954,13 @@ string reduceSpacesAndTrim(string input)
     {
         // if input or out put redirection, amke sure there is a string(file)
         // to perform the operation on
-        if (brokenString[i]== ">" || brokenString[i] == "<")
+        if (brokenString[i]== ">" || brokenString[i]== ">z" || brokenString[i] == "<" || brokenString[i] == "<z")
         {
             //if the token is first or last char or the next char is not a alpahbet or number
-            //then it is incorrect
-            if (i == brokenString.size()-1 || !isalnum(brokenString[i+1][0] ) || i==0)
+            //(or a $ argument of a function) then it is incorrect
+            if (i == brokenString.size()-1 || !(isalnum(brokenString[i+1][0]) || brokenString[i+1][0] == '$') || i==0)
             {
-                perror("Invalid input / output redirecting command \n");
-                if (isFile)
-                {
-                    exit(1);
-                }
+                error = "Invalid input / output redirecting command \n";
                 result ="";
                 return result;
             }
@@ -452,11 +972,7 @@ string reduceSpacesAndTrim(string input)
             // pipe command at the beginning or end
             if (i==brokenString.size()-1 || i==0)
             {
-                perror("invalid pipe command \n");
-                if (isFile)
-                {
-                    exit(1);
-                }
+                error = "invalid pipe command \n";
                 result ="";
                 return result;
             }
@@ -475,11 +991,7 @@ string reduceSpacesAndTrim(string input)
                 //illegal to have & then |
                 if(brokenString[i+1]=="|")
                 {
-                    perror("invalid parallel commands together \n");
-                    if (isFile)
-                    {
-                        exit(1);
-                    }
+                    error = "invalid parallel commands together \n";
                     result ="";
                     return result;
                 }
@@ -487,11 +999,7 @@ string reduceSpacesAndTrim(string input)
             //error to have & in th beginning
             if (i==0)
             {
-                perror("invalid parallel command \n");
-                if (isFile)
-                {
-                    exit(1);
-                }
+                error = "invalid parallel command \n";
                 result ="";
                 return result;
             }
@@ -522,12 +1030,6 @@ string reduceSpacesAndTrim(string input)
         }
     }
 
-    //if the command is exit then exit the code
-    if(result=="exit")
-    {
-        exit(0);
-    }
-
     return result;
 
 }
@@ -562,19 +1064,20 @@ void generateTokens(string input, vector<string> &tokens, string &redirectedOutp
         if (input[i] == ' ' && i != input.size() - 1)
         {
             // Check if the current token is an output redirection symbol
-            if (str == ">")
+            if (str == ">" || str == ">z")
             {
                 isRedirectOutput = true;
             }
             // Check if the current token is an input redirection symbol
-            else if (str == "<")
+            else if (str == "<" || str == "<z")
             {
                 isRedirectInput = true;
             }
-            //check if  it is a redirectedInput
+            //check if  it is a redirectedInput, the file becomes the stdin
+            //of the command instead of one of its arguments
             else if (isRedirectInput)
             {
-                tokens.push_back(str);
+                redirectedInputFileName = str;
                 isRedirectInput = false;
             }
             // check if it is not redirected output
@@ -592,8 +1095,13 @@ void generateTokens(string input, vector<string> &tokens, string &redirectedOutp
             str += input[i];
         }
     }
+    //if the last word follows a < then it is the input file
+    if (isRedirectInput)
+    {
+        redirectedInputFileName = str;
+    }
     //if not redirected input then push to the token
-    if (!isRedirectOutput)
+    else if (!isRedirectOutput)
     {
         tokens.push_back(str);
     }
@@ -610,8 +1118,9 @@ void generateTokens(string input, vector<string> &tokens, string &redirectedOutp
  * @brief Executes inbuilt shell commands such as 'cd' and variable assignment.
  *
  * This function takes a vector of tokens representing a command and checks if it is an
- * inbuilt command. It supports changing the current directory ('cd') and setting environment
- * variables (e.g., variable=value).
+ * inbuilt command. It supports changing the current directory ('cd')
+ * and setting environment variables (e.g., variable=value). Shell functions are
+ * called by executeCommands, which keeps their exit status.
  *
  * @param tokens A vector of strings representing the tokens of the command.
  * @return Returns 0 if the command is executed successfully, -1 if there is an error,
@@ -619,7 +1128,6 @@ void generateTokens(string input, vector<string> &tokens, string &redirectedOutp
  */
 int executeInbuiltCommands(vector<string> tokens)
 {
-
     // Check if the command is 'cd'
     if (tokens[0] == "cd")
     {
@@ -663,7 +1171,9 @@ int executeInbuiltCommands(vector<string> tokens)
         string value = tokens[0].substr(loc + 1);
 
         // Set environment variable using setenve and the variables converted
-        // c string
+        // c string. Function bodies run by the job pool workers assign too,
+        // the assignment and its journal entry are taken together
+        lock_guard<mutex> guard(environmentLock);
         if (setenv(variable.c_str(), value.c_str(), 1) != 0)
         {
             //error while executing
@@ -675,6 +1185,11 @@ int executeInbuiltCommands(vector<string> tokens)
             //return -1 if error
             return -1;
         }
+        // the journal records the assignment with the line
+        if (journalFd != -1)
+        {
+            environmentChanges.push_back(tokens[0]);
+        }
         // exit inbuilt function is already implemented
         return 0;
     }
@@ -689,22 +1204,157 @@ int executeInbuiltCommands(vector<string> tokens)
  * and executes the commands using execvp.
  *
  * @param commands A vector of `commandsToExecute` structures representing the commands to be executed.
- * @return Returns 0 upon successful execution; otherwise, exits the program with appropriate error messages.
+ * @return Returns the exit status of the last command waited on (0 on success); exits the
+ *         program with appropriate error messages on fatal errors.
  */
 int executeCommands(vector<commandsToExecute> commands)
 {
+    // the builtin running these commands is already past its deadline
+    long long now = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    if (stageDeadlineMs != 0 && now >= stageDeadlineMs)
+    {
+        return 124;
+    }
+    // While a $(...) output is captured, what would go to the shell's stdout
+    // goes to the capture
+    if (stdoutOverrideFd != -1)
+    {
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            if (commands[i].outputFd == -1)
+            {
+                commands[i].outputFd = stdoutOverrideFd;
+            }
+        }
+    }
+    // the same for the input of a function body
+    if (stdinOverrideFd != -1)
+    {
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            if (commands[i].inputFd == -1 && !commands[i].isPipeEnd && !commands[i].redirectedInputFromFile)
+            {
+                commands[i].inputFd = stdinOverrideFd;
+            }
+        }
+    }
+    // Compressed redirections go through a pipe to threads of the shell that
+    // compress the output on its way to the file, or decompress the file on its
+    // way to the input. If the file can't be opened the command keeps its plain
+    // redirection and the child reports the error
+    vector<thread> compressionStages;
+    // ends of the stage pipes the children use, closed by the parent once forked
+    vector<int> stageFds;
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        if (commands[i].redirectOutputToFile && !commands[i].outputCompression.empty())
+        {
+            int fileFd = open(commands[i].redirectOutputFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            int temp[2];
+            if (fileFd != -1 && pipe2(temp, O_CLOEXEC) == 0)
+            {
+                commands[i].redirectOutputToFile = false;
+                commands[i].outputFd = temp[1];
+                stageFds.push_back(temp[1]);
+                compressionStages.emplace_back(compressStream, temp[0], fileFd, commands[i].outputCompression,
+                                               commands[i].redirectOutputFileName);
+            }
+        }
+        if (commands[i].redirectedInputFromFile && !commands[i].inputCompression.empty())
+        {
+            int fileFd = open(commands[i].redirectedInputFileName.c_str(), O_RDONLY | O_CLOEXEC);
+            int temp[2];
+            if (fileFd != -1 && pipe2(temp, O_CLOEXEC) == 0)
+            {
+                commands[i].redirectedInputFromFile = false;
+                commands[i].inputFd = temp[0];
+                stageFds.push_back(temp[0]);
+                compressionStages.emplace_back(decompressStream, fileFd, temp[1], commands[i].inputCompression,
+                                               commands[i].redirectedInputFileName);
+            }
+        }
+    }
+
     //initialize 2d vector to hold the file deccriptiors
     vector<vector<int>> pipes(commands.size() + 1);
-    //vector to keep track of the pids
-    vector<int> pids(commands.size());
+    //vector to keep track of the pids, -1 for commands that were not forked
+    vector<int> pids(commands.size(), -1);
+    //exit status of the last command that was waited on
+    int lastStatus = 0;
+    // Deadline of every command in milliseconds of the steady clock, 0 for none.
+    // Without any deadline the children are waited on as before at no cost
+    vector<long long> deadlines(commands.size(), 0);
+    bool hasDeadline = false;
+    // A command in a process group of its own is in the background for the
+    // terminal, reading it would stop the command and Ctrl-C would not reach it.
+    // With a terminal on stdin the commands stay in the shell's group and only
+    // the command itself is killed at its deadline
+    bool ownGroup = !isatty(0);
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        long long limit = commands[i].timeoutMs;
+        if (options.lineTimeoutMs > 0 && (limit == 0 || options.lineTimeoutMs < limit))
+        {
+            limit = options.lineTimeoutMs;
+        }
+        if (limit > 0)
+        {
+            deadlines[i] = now + limit;
+            hasDeadline = true;
+        }
+        // nothing started by a builtin outlives the builtin's own deadline
+        if (stageDeadlineMs != 0 && (deadlines[i] == 0 || stageDeadlineMs < deadlines[i]))
+        {
+            deadlines[i] = stageDeadlineMs;
+            hasDeadline = true;
+        }
+    }
+    // a recorded line needs the time every child exits, and --mem-budget the
+    // RSS of every child while it runs, they are watched like the ones with a
+    // deadline
+    bool watchChildren = hasDeadline || recordFd != -1 || options.memBudget > 0;
+    vector<chrono::steady_clock::time_point> startTimes(commands.size());
+    // 0 running, 1 sent SIGTERM, 2 sent SIGKILL, 3 reaped or not forked, see
+    // waitWithDeadlines
+    vector<int> stages(commands.size(), 3);
+    vector<int> statuses(commands.size(), 0);
+    // commands whose status counts for the line, the forked ones and the
+    // builtins that run the commands of the line themselves
+    vector<bool> reported(commands.size(), false);
+    // parallel and batch-args running next to the other commands of a pipeline
+    vector<thread> builtinStages;
+    // With --mem-budget the jobs of a & line are launched one after the other
+    // as memory allows, so each job gives its pipes back as soon as it started
+    size_t lineJobs = 0;
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        if (!commands[i].isPipeEnd)
+        {
+            lineJobs++;
+        }
+    }
+    bool admission = options.memBudget > 0 && lineJobs > 1;
+    // memory every command is expected to use, a command never seen before
+    // gets an equal share of the budget rather than nothing
+    vector<size_t> estimates(commands.size(), 0);
+    for (size_t i = 0; admission && i < commands.size(); i++)
+    {
+        estimates[i] = knownPeakRss(commands[i].tokens[0]);
+        if (estimates[i] == 0)
+        {
+            estimates[i] = options.memBudget / lineJobs;
+        }
+    }
 
     // create the pipes for each parallel command using pipe() function
     for (size_t i = 0; i < pipes.size(); i++)
     {
         //initialize and array
         int temp[2];
-        //use the pipe function for each parallel command
-        if (pipe(temp) == -1)
+        //use the pipe function for each parallel command. The FD's are close
+        //on exec so children forked by other threads never inherit them, dup2
+        //clears the flag on the copies a child actually uses
+        if (pipe2(temp, O_CLOEXEC) == -1)
         {
             // Handle pipe creation error
             perror("error creating a pipe");
@@ -714,10 +1364,162 @@ int executeCommands(vector<commandsToExecute> commands)
         pipes[i].push_back(temp[0]);
         pipes[i].push_back(temp[1]);
     }
+    // When the output is grouped, every parallel command (a whole pipeline for
+    // pipes) writes its stdout and stderr to its own pair of pipes that the
+    // collector reads
+    vector<int> groupReadFds;
+    vector<int> groupWriteFds;
+    size_t jobCount = 0;
+    if (!options.groupOutput.empty())
+    {
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            if (!commands[i].isPipeEnd)
+            {
+                jobCount++;
+            }
+        }
+    }
+    if (jobCount > 1)
+    {
+        // write ends of the stdout and stderr pipes of the current job
+        int jobFds[2] = {-1, -1};
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            // a new job starts with every command that does not read a pipe
+            if (!commands[i].isPipeEnd)
+            {
+                for (int stream = 0; stream < 2; stream++)
+                {
+                    int temp[2];
+                    if (pipe2(temp, O_CLOEXEC) == -1)
+                    {
+                        perror("error creating a pipe");
+                        exit(1);
+                    }
+                    groupReadFds.push_back(temp[0]);
+                    groupWriteFds.push_back(temp[1]);
+                    jobFds[stream] = temp[1];
+                }
+            }
+            // stdout only matters for the last command of a pipeline
+            if (commands[i].outputFd == -1 && !commands[i].isPipeStart)
+            {
+                commands[i].outputFd = jobFds[0];
+            }
+            if (commands[i].errorFd == -1)
+            {
+                commands[i].errorFd = jobFds[1];
+            }
+        }
+        // anything buffered by the shell must be out before the children write
+        cout.flush();
+    }
+    // A held job waits for the earlier ones to exit, they must be able to
+    // write their output meanwhile
+    thread collector;
+    if (admission && !groupReadFds.empty())
+    {
+        collector = thread(collectGroupedOutput, groupReadFds, jobCount);
+    }
+    // index of the next job in groupWriteFds
+    size_t groupJob = 0;
+
     // Loop through each command for parallel and pipe, if it is a single
     //then it will just execute it once
     for (size_t  i = 0; i < commands.size(); i++)
     {
+        // the previous job is fully started, the parent's ends of its pipes
+        // would keep its commands from seeing the end of their input
+        if (admission && i > 0 && !commands[i].isPipeEnd)
+        {
+            size_t jobStart = i - 1;
+            while (jobStart > 0 && commands[jobStart].isPipeEnd)
+            {
+                jobStart--;
+            }
+            for (size_t j = jobStart; j < i; j++)
+            {
+                close(pipes[j + 1][0]);
+                close(pipes[j + 1][1]);
+                pipes[j + 1] = {-1, -1};
+            }
+            if (!groupWriteFds.empty())
+            {
+                close(groupWriteFds[2 * groupJob]);
+                close(groupWriteFds[2 * groupJob + 1]);
+                groupWriteFds[2 * groupJob] = -1;
+                groupWriteFds[2 * groupJob + 1] = -1;
+                groupJob++;
+            }
+            // wait until the memory of the running jobs leaves room for this one
+            admitJob(commands, i, estimates, pids, deadlines, startTimes, stages, statuses);
+        }
+        // parallel, batch-args and functions need the whole command (its
+        // redirections) so they are dispatched before the other inbuilt commands
+        bool isFunction = functions.find(commands[i].tokens[0]) != functions.end();
+        if (commands[i].tokens[0] == "parallel" || commands[i].tokens[0] == "batch-args" || isFunction)
+        {
+            // In a pipeline the builtin runs on a thread, the commands after it
+            // must be started to read its output. It gets its own copies of the
+            // descriptors it uses since the parent closes the line's ones
+            bool threaded = commands[i].isPipeStart || commands[i].isPipeEnd;
+            commandsToExecute builtin = commands[i];
+            if (builtin.isPipeEnd)
+            {
+                builtin.inputFd = fcntl(pipes[i][0], F_DUPFD_CLOEXEC, 0);
+            }
+            else if (threaded && builtin.inputFd != -1)
+            {
+                builtin.inputFd = fcntl(builtin.inputFd, F_DUPFD_CLOEXEC, 0);
+            }
+            if (builtin.isPipeStart)
+            {
+                builtin.outputFd = fcntl(pipes[i + 1][1], F_DUPFD_CLOEXEC, 0);
+            }
+            else if (threaded && builtin.outputFd != -1)
+            {
+                builtin.outputFd = fcntl(builtin.outputFd, F_DUPFD_CLOEXEC, 0);
+            }
+            auto runBuiltin = [threaded, isFunction](commandsToExecute builtin)
+            {
+                int status = isFunction ? runFunctionCall(builtin)
+                             : builtin.tokens[0] == "parallel" ? runParallel(builtin) : runBatchArgs(builtin);
+                if (threaded)
+                {
+                    // the next command of the pipeline sees the end of its input
+                    if (builtin.inputFd != -1)
+                    {
+                        close(builtin.inputFd);
+                    }
+                    if (builtin.outputFd != -1)
+                    {
+                        close(builtin.outputFd);
+                    }
+                }
+                return status;
+            };
+            if (threaded)
+            {
+                // the commands the builtin starts are killed at its deadline
+                long long deadline = deadlines[i];
+                builtinStages.emplace_back([&statuses, i, runBuiltin, builtin, deadline]()
+                {
+                    stageDeadlineMs = deadline;
+                    statuses[i] = runBuiltin(builtin);
+                });
+            }
+            else
+            {
+                // a timeout prefix or --line-timeout bounds the whole call
+                long long previous = stageDeadlineMs;
+                stageDeadlineMs = deadlines[i];
+                statuses[i] = runBuiltin(builtin);
+                stageDeadlineMs = previous;
+            }
+            reported[i] = true;
+            continue;
+        }
         // Check if the command is an inbuilt command (e.g., exit, cd)
         int isInbuilt = executeInbuiltCommands(commands[i].tokens);
         // If it's an inbuilt command continue
@@ -735,11 +1537,51 @@ int executeCommands(vector<commandsToExecute> commands)
                 close(pipes[j][0]);
                 close(pipes[j][1]);
             }
+            for (size_t j = 0; j < builtinStages.size(); j++)
+            {
+                builtinStages[j].join();
+            }
+            // the commands started before the error still write their output
+            if (!groupReadFds.empty())
+            {
+                for (size_t j = 0; j < groupWriteFds.size(); j++)
+                {
+                    if (groupWriteFds[j] != -1)
+                    {
+                        close(groupWriteFds[j]);
+                    }
+                }
+                if (collector.joinable())
+                {
+                    collector.join();
+                }
+                else
+                {
+                    collectGroupedOutput(groupReadFds, jobCount);
+                }
+            }
+            for (size_t j = 0; j < stageFds.size(); j++)
+            {
+                close(stageFds[j]);
+            }
+            for (size_t j = 0; j < compressionStages.size(); j++)
+            {
+                compressionStages[j].join();
+            }
             return 0;
         }
 
         else if (isInbuilt == 1)
         {
+            // a replayed child only sleeps as long as it ran, looked up before
+            // the fork since the child must not take locks
+            long long stubNs = -1;
+            int stubStatus = 0;
+            if (options.stubChildren)
+            {
+                takeStub(commands[i].tokens[0], stubNs, stubStatus);
+            }
+            startTimes[i] = chrono::steady_clock::now();
             // Fork a child process for the current command and store it in the vector
             pids[i] = fork();
 
@@ -754,6 +1596,21 @@ int executeCommands(vector<commandsToExecute> commands)
             {
                 // Child process logic
 
+                // the shell ignores SIGPIPE, the command must not
+                signal(SIGPIPE, SIG_DFL);
+                // the pipes of <(...) and >(...) stay open across exec, they are
+                // passed by their number
+                for (size_t j = 0; j < commands[i].inheritFds.size(); j++)
+                {
+                    fcntl(commands[i].inheritFds[j], F_SETFD, 0);
+                }
+                // a command with a deadline leads its own process group so
+                // everything it starts is killed with it
+                if (deadlines[i] != 0 && ownGroup)
+                {
+                    setpgid(0, 0);
+                }
+
                 // Create a vector of C-style strings (char*) for passing arguments to execvp
                 vector<char *> cArgs;
 
@@ -848,23 +1705,84 @@ int executeCommands(vector<commandsToExecute> commands)
                     //close the redundant FD
                     close(outputFile);
                 }
+                // Check if the command reads its input from a file
+                if (commands[i].redirectedInputFromFile)
+                {
+                    // Open the specified file for reading
+                    int inputFile = open(commands[i].redirectedInputFileName.c_str(), O_RDONLY);
+                    if (inputFile == -1)
+                    {
+                        perror("Error opening input file ");
+                        exit(1);
+                    }
+                    // Redirect standard input to the file
+                    if (dup2(inputFile, 0) == -1)
+                    {
+                        perror("Error duplicating file descriptor");
+                        exit(1);
+                    }
+                    close(inputFile);
+                }
+                // Check if the input comes from the caller, e.g. a decompression stage
+                if (commands[i].inputFd != -1 && !commands[i].redirectedInputFromFile)
+                {
+                    if (dup2(commands[i].inputFd, 0) == -1)
+                    {
+                        perror("Error duplicating file descriptor");
+                        exit(1);
+                    }
+                }
+                // If the caller captures the output, stdout goes to its FD unless
+                // it already goes to a pipe or a file
+                if (commands[i].outputFd != -1 && !commands[i].isPipeStart && !commands[i].redirectOutputToFile)
+                {
+                    if (dup2(commands[i].outputFd, 1) == -1)
+                    {
+                        perror("Error duplicating file descriptor");
+                        exit(1);
+                    }
+                }
+                // stderr is always captured when requested
+                if (commands[i].errorFd != -1)
+                {
+                    if (dup2(commands[i].errorFd, 2) == -1)
+                    {
+                        perror("Error duplicating file descriptor");
+                        exit(1);
+                    }
+                }
                 // Check if it is not the starting point of a pipe
                 if (!commands[i].isPipeStart)
                 {
                     // Close the write end of the current pipe
                     close(pipes[i + 1][1]);
                 }
+                // the setup above is the shell's own work, the command itself is
+                // replaced by its recorded duration
+                if (stubNs >= 0)
+                {
+                    this_thread::sleep_for(chrono::nanoseconds(stubNs));
+                    _exit(stubStatus);
+                }
                 // Execute the command using execvp function that takes the tokens
                 //converted to cstring
                 if (execvp(commands[i].tokens[0].c_str(), cArgs.data()) == -1)
                 {
+                    // keep the error of execvp, closing the pipes overwrites errno
+                    int execError = errno;
                     // Handle execvp error and close all pipes
                     for (size_t  j = 0; j < pipes.size(); j++)
                     {
                         close(pipes[j][0]);
                         close(pipes[j][1]);
                     }
+                    errno = execError;
                     perror("Please check the command");
+                    // the arguments do not fit in ARG_MAX
+                    if (execError == E2BIG)
+                    {
+                        cerr << "Prefix the command with batch-args to split it" << endl;
+                    }
                     exit(0);
                 }
                 // Close file descriptors that were just used
@@ -879,22 +1797,96 @@ int executeCommands(vector<commandsToExecute> commands)
                 // Exit the child process after executing the command
                 return 0;
             }
+            // set it in the parent too, the kill may come before the child runs
+            if (deadlines[i] != 0 && ownGroup)
+            {
+                setpgid(pids[i], pids[i]);
+            }
+            stages[i] = 0;
+            reported[i] = true;
         }
     }
     // Close all pipes in the parent process at the end
     for (size_t  j = 0; j < pipes.size(); j++)
     {
-        close(pipes[j][0]);
-        close(pipes[j][1]);
+        if (pipes[j][0] != -1)
+        {
+            close(pipes[j][0]);
+            close(pipes[j][1]);
+        }
+    }
+    // The children hold their ends of the compression stage pipes now
+    for (size_t j = 0; j < stageFds.size(); j++)
+    {
+        close(stageFds[j]);
+    }
+    // Hand the grouped output pipes to the collector, the parent's write ends
+    // are closed first so the collector sees the end of every stream
+    // The collector runs next to the wait when a command has a deadline, the
+    // output of a hung command would never end otherwise
+    if (!groupReadFds.empty())
+    {
+        for (size_t j = 0; j < groupWriteFds.size(); j++)
+        {
+            if (groupWriteFds[j] != -1)
+            {
+                close(groupWriteFds[j]);
+            }
+        }
+        if (collector.joinable())
+        {
+            // already started for --mem-budget
+        }
+        else if (watchChildren)
+        {
+            collector = thread(collectGroupedOutput, groupReadFds, jobCount);
+        }
+        else
+        {
+            collectGroupedOutput(groupReadFds, jobCount);
+        }
+    }
+    if (watchChildren)
+    {
+        waitWithDeadlines(commands, pids, deadlines, startTimes, stages, statuses, -1);
     }
     // Wait for all child processes to complete using waitpid and all
     //pid that were created and stored in pids vector
-    for (size_t  i = 0; i < commands.size(); i++)
+    for (size_t  i = 0; i < commands.size() && !watchChildren; i++)
+    {
+        //inbuilt commands were never forked, held jobs may have reaped some
+        if (stages[i] == 3)
+        {
+            continue;
+        }
+        int status = 0;
+        waitpid(pids[i], &status, 0);
+        statuses[i] = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    // the builtins of a pipeline end once the commands around them did, or at
+    // their deadline since everything they start is killed by then
+    for (size_t j = 0; j < builtinStages.size(); j++)
     {
-        waitpid(pids[i], NULL, 0);
+        builtinStages[j].join();
     }
-    //all childs completed, now exit
-    return 0;
+    if (collector.joinable())
+    {
+        collector.join();
+    }
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        if (reported[i])
+        {
+            lastStatus = statuses[i];
+        }
+    }
+    // the compression stages end once the children closed their pipes
+    for (size_t j = 0; j < compressionStages.size(); j++)
+    {
+        compressionStages[j].join();
+    }
+    //all childs completed, return the status of the last one
+    return lastStatus;
 }
 
 
@@ -951,4 +1943,3422 @@ bool isOutputOpen(ofstream &fout, string fileName)
 
     // opened successfully
     return true;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Creates a command with default values for every property.
+ *
+ * @param tokens The argv of the command.
+ * @return A command that reads the shell's stdin and writes to its stdout.
+ */
+commandsToExecute newCommand(vector<string> tokens)
+{
+    commandsToExecute command;
+    command.tokens = tokens;
+    command.redirectOutputToFile = false;
+    command.redirectedInputFromFile = false;
+    command.isPipeStart = false;
+    command.isPipeEnd = false;
+    return command;
+}
+
+
+/**
+ * @brief Computes how many bytes of argument list a spawned command may use.
+ *
+ * execvp fails with E2BIG when the arguments and the environment together go
+ * over ARG_MAX, so the environment size and a 2048 byte headroom (the same one
+ * xargs keeps) are subtracted. Every argument costs its length, its null
+ * terminator and its pointer in argv.
+ *
+ * @return The number of bytes left for arguments.
+ */
+size_t availableArgumentSpace()
+{
+    long argMax = sysconf(_SC_ARG_MAX);
+    //fall back to the POSIX minimum if the limit is unknown
+    if (argMax <= 0)
+    {
+        argMax = _POSIX_ARG_MAX;
+    }
+    //bytes used by the environment
+    size_t used = 2048;
+    for (char **env = environ; *env != nullptr; env++)
+    {
+        used += strlen(*env) + 1 + sizeof(char *);
+    }
+    if ((size_t)argMax <= used)
+    {
+        return 0;
+    }
+    return argMax - used;
+}
+
+
+/**
+ * @brief Copies everything captured in a memfd to a file descriptor.
+ *
+ * @param captureFd The memfd the child wrote to.
+ * @param target The file descriptor to copy the output to.
+ */
+void writeCapturedOutput(int captureFd, int target)
+{
+    char buffer[65536];
+    //rewind to the start of what the child wrote
+    lseek(captureFd, 0, SEEK_SET);
+    ssize_t count;
+    while ((count = read(captureFd, buffer, sizeof(buffer))) > 0)
+    {
+        //write may be partial on pipes and terminals
+        ssize_t written = 0;
+        while (written < count)
+        {
+            ssize_t result = write(target, buffer + written, count - written);
+            if (result == -1)
+            {
+                return;
+            }
+            written += result;
+        }
+    }
+}
+
+
+/*
+    queue of job indexes owned by one worker slot of a job pool. The owner
+    takes jobs from the front, idle workers steal from the back
+*/
+struct workerQueue {
+    deque<size_t> jobs;
+    mutex lock;
+};
+
+
+/**
+ * @brief Runs a list of commands on a pool of worker slots.
+ *
+ * The jobs are split in contiguous blocks between the workers. Each worker runs
+ * the jobs of its own queue and, once it is empty, steals from the back of the
+ * fullest other queue so slow jobs never leave workers idle. Every job is spawned
+ * through executeCommands with its stdout and stderr captured in memfds, and the
+ * captured output is written as one block once the job finishes so the output of
+ * two jobs never interleaves. The throughput is reported on stderr.
+ *
+ * @param jobs The argv of every job.
+ * @param workerCount The number of jobs that may run at the same time.
+ * @param name The name of the builtin, used in the report.
+ * @param outputTarget The file descriptor the stdout of the jobs is written to.
+ * @param input A command whose input (a < file, a descriptor) every job reads.
+ * @return The number of jobs that failed.
+ */
+size_t runJobPool(vector<vector<string>> jobs, size_t workerCount, string name, int outputTarget,
+                  commandsToExecute input)
+{
+    //never start more workers than there are jobs
+    workerCount = max((size_t)1, min(workerCount, jobs.size()));
+    vector<workerQueue> queues(workerCount);
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        queues[i * workerCount / jobs.size()].jobs.push_back(i);
+    }
+
+    //serializes the writes of the captured output
+    mutex outputLock;
+    size_t failed = 0;
+    //anything buffered by the shell must be out before the children write
+    cout.flush();
+    auto start = chrono::steady_clock::now();
+    // the workers run the jobs under the deadline of the builtin
+    long long deadline = stageDeadlineMs;
+
+    auto worker = [&](size_t self)
+    {
+        stageDeadlineMs = deadline;
+        while (true)
+        {
+            size_t job = 0;
+            bool found = false;
+            //take the next job of our own queue
+            {
+                lock_guard<mutex> guard(queues[self].lock);
+                if (!queues[self].jobs.empty())
+                {
+                    job = queues[self].jobs.front();
+                    queues[self].jobs.pop_front();
+                    found = true;
+                }
+            }
+            //otherwise steal from the back of the fullest queue
+            while (!found)
+            {
+                size_t victim = self;
+                size_t most = 0;
+                for (size_t i = 0; i < queues.size(); i++)
+                {
+                    lock_guard<mutex> guard(queues[i].lock);
+                    if (queues[i].jobs.size() > most)
+                    {
+                        most = queues[i].jobs.size();
+                        victim = i;
+                    }
+                }
+                //no jobs left anywhere
+                if (most == 0)
+                {
+                    return;
+                }
+                lock_guard<mutex> guard(queues[victim].lock);
+                //the victim may have been emptied meanwhile, then look again
+                if (!queues[victim].jobs.empty())
+                {
+                    job = queues[victim].jobs.back();
+                    queues[victim].jobs.pop_back();
+                    found = true;
+                }
+            }
+
+            //capture the output of the job
+            int outputFd = memfd_create("mish-job-output", MFD_CLOEXEC);
+            int errorFd = memfd_create("mish-job-error", MFD_CLOEXEC);
+            if (outputFd == -1 || errorFd == -1)
+            {
+                perror("error creating output buffer");
+                exit(1);
+            }
+            commandsToExecute command = newCommand(jobs[job]);
+            command.redirectedInputFromFile = input.redirectedInputFromFile;
+            command.redirectedInputFileName = input.redirectedInputFileName;
+            command.inputCompression = input.inputCompression;
+            command.inputFd = input.inputFd;
+            command.outputFd = outputFd;
+            command.errorFd = errorFd;
+            int status = executeCommands({command});
+
+            //write the whole output of the job at once
+            {
+                lock_guard<mutex> guard(outputLock);
+                writeCapturedOutput(outputFd, outputTarget);
+                writeCapturedOutput(errorFd, 2);
+                if (status != 0)
+                {
+                    failed++;
+                }
+            }
+            close(outputFd);
+            close(errorFd);
+        }
+    };
+
+    vector<thread> workers;
+    for (size_t i = 0; i < workerCount; i++)
+    {
+        workers.emplace_back(worker, i);
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << name << ": " << jobs.size() << " jobs on " << workerCount << " workers in "
+         << seconds << " s (" << (seconds > 0 ? jobs.size() / seconds : 0) << " jobs/s)";
+    if (failed > 0)
+    {
+        cerr << ", " << failed << " failed";
+    }
+    cerr << endl;
+    return failed;
+}
+
+
+/**
+ * @brief Parses a positive number given to an option of a builtin.
+ *
+ * @param text The text of the option value.
+ * @param value Updated with the parsed number.
+ * @return Returns true if the text is a positive number.
+ */
+bool parseCount(string text, size_t &value)
+{
+    char *end = nullptr;
+    unsigned long parsed = strtoul(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || parsed == 0)
+    {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+
+/**
+ * @brief Implements the parallel builtin.
+ *
+ * parallel [-j N] [-n M] command args...
+ *
+ * Runs command once per input line, N at a time (the number of CPUs by default).
+ * The lines are read from the file given with <, from the pipe before it or
+ * from stdin. The output goes to the file given with >, to the pipe after it or
+ * to stdout. Each {} in the
+ * arguments is replaced by the input; without {} the input is appended to the
+ * arguments. When {} is a whole argument or is missing, up to M inputs (1 by
+ * default) are passed to a single invocation as long as they fit in ARG_MAX.
+ *
+ * @param command The parsed parallel command.
+ * @return Returns 0 if every job succeeded, 1 otherwise.
+ */
+int runParallel(commandsToExecute command)
+{
+    size_t workerCount = max(1u, thread::hardware_concurrency());
+    size_t batchSize = 1;
+    size_t i = 1;
+    //read the options
+    while (i < command.tokens.size() && (command.tokens[i] == "-j" || command.tokens[i] == "-n"))
+    {
+        size_t &value = command.tokens[i] == "-j" ? workerCount : batchSize;
+        if (i + 1 >= command.tokens.size() || !parseCount(command.tokens[i + 1], value))
+        {
+            perror("Invalid arguments for parallel\n");
+            if (isFile)
+            {
+                exit(1);
+            }
+            return 1;
+        }
+        i += 2;
+    }
+    //the rest is the command to run
+    vector<string> pattern(command.tokens.begin() + i, command.tokens.end());
+    if (pattern.empty())
+    {
+        perror("parallel needs a command\n");
+        if (isFile)
+        {
+            exit(1);
+        }
+        return 1;
+    }
+
+    //read the inputs from the redirected file or stdin
+    vector<string> inputs;
+    string line;
+    if (command.redirectedInputFromFile)
+    {
+        ifstream fin(command.redirectedInputFileName);
+        if (!fin.is_open())
+        {
+            perror("Unable to open input file");
+            if (isFile)
+            {
+                exit(1);
+            }
+            return 1;
+        }
+        while (getline(fin, line))
+        {
+            if (!line.empty())
+            {
+                inputs.push_back(line);
+            }
+        }
+    }
+    else if (command.inputFd != -1)
+    {
+        //the pipe before it, or a decompression stage
+        string data;
+        char buffer[65536];
+        ssize_t count;
+        while ((count = read(command.inputFd, buffer, sizeof(buffer))) != 0)
+        {
+            if (count == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                perror("error reading the input of parallel");
+                break;
+            }
+            data.append(buffer, count);
+        }
+        stringstream lines(data);
+        while (getline(lines, line))
+        {
+            if (!line.empty())
+            {
+                inputs.push_back(line);
+            }
+        }
+    }
+    else
+    {
+        while (getline(cin, line))
+        {
+            if (!line.empty())
+            {
+                inputs.push_back(line);
+            }
+        }
+        //an interactive shell keeps reading commands after the end of input
+        cin.clear();
+    }
+
+    //find where the inputs go
+    bool standalone = false;
+    bool embedded = false;
+    size_t patternSize = 0;
+    for (size_t j = 0; j < pattern.size(); j++)
+    {
+        if (pattern[j] == "{}")
+        {
+            standalone = true;
+        }
+        else
+        {
+            if (pattern[j].find("{}") != string::npos)
+            {
+                embedded = true;
+            }
+            patternSize += pattern[j].size() + 1 + sizeof(char *);
+        }
+    }
+    //an input inside a bigger argument can only be passed one at a time
+    if (embedded)
+    {
+        batchSize = 1;
+    }
+    size_t space = availableArgumentSpace();
+
+    //group the inputs in batches that fit in the argument list
+    vector<vector<string>> jobs;
+    size_t next = 0;
+    while (next < inputs.size())
+    {
+        size_t first = next;
+        size_t used = patternSize;
+        //always take at least one input, execvp reports it if it is too big
+        do
+        {
+            used += inputs[next].size() + 1 + sizeof(char *);
+            next++;
+        } while (next < inputs.size() && next - first < batchSize
+                 && used + inputs[next].size() + 1 + sizeof(char *) <= space);
+
+        vector<string> tokens;
+        for (size_t j = 0; j < pattern.size(); j++)
+        {
+            if (pattern[j] == "{}")
+            {
+                tokens.insert(tokens.end(), inputs.begin() + first, inputs.begin() + next);
+            }
+            else if (embedded && pattern[j].find("{}") != string::npos)
+            {
+                //replace every {} of the argument with the input
+                string argument = pattern[j];
+                size_t loc = 0;
+                while ((loc = argument.find("{}", loc)) != string::npos)
+                {
+                    argument.replace(loc, 2, inputs[first]);
+                    loc += inputs[first].size();
+                }
+                tokens.push_back(argument);
+            }
+            else
+            {
+                tokens.push_back(pattern[j]);
+            }
+        }
+        if (!standalone && !embedded)
+        {
+            tokens.insert(tokens.end(), inputs.begin() + first, inputs.begin() + next);
+        }
+        jobs.push_back(tokens);
+    }
+
+    if (jobs.empty())
+    {
+        return 0;
+    }
+    //the output goes to the > file, the pipe after it or stdout
+    int outputTarget = command.outputFd != -1 ? command.outputFd : 1;
+    int outputFile = -1;
+    if (command.redirectOutputToFile)
+    {
+        outputFile = open(command.redirectOutputFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (outputFile == -1)
+        {
+            perror("Error opening output file ");
+            if (isFile)
+            {
+                exit(1);
+            }
+            return 1;
+        }
+        outputTarget = outputFile;
+    }
+    //the jobs read the shell's stdin, parallel took the inputs
+    size_t failed = runJobPool(jobs, workerCount, "parallel", outputTarget, newCommand({}));
+    if (outputFile != -1)
+    {
+        close(outputFile);
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+
+/**
+ * @brief Appends bytes to the end of an output ring, growing it when full.
+ *
+ * @param ring The ring to append to.
+ * @param bytes The bytes to append.
+ * @param count The number of bytes.
+ */
+void appendToRing(outputRing &ring, const char *bytes, size_t count)
+{
+    // grow to the next power of two that fits, keeping the buffered bytes in order
+    if (ring.size + count > ring.data.size())
+    {
+        size_t capacity = max((size_t)4096, ring.data.size());
+        while (capacity < ring.size + count)
+        {
+            capacity *= 2;
+        }
+        vector<char> grown(capacity);
+        if (ring.size > 0)
+        {
+            size_t first = min(ring.size, ring.data.size() - ring.head);
+            memcpy(grown.data(), ring.data.data() + ring.head, first);
+            memcpy(grown.data() + first, ring.data.data(), ring.size - first);
+        }
+        ring.data.swap(grown);
+        ring.head = 0;
+    }
+    // copy in at most two pieces, before and after the wrap around
+    size_t tail = (ring.head + ring.size) % ring.data.size();
+    size_t first = min(count, ring.data.size() - tail);
+    memcpy(ring.data.data() + tail, bytes, first);
+    memcpy(ring.data.data(), bytes + first, count - first);
+    ring.size += count;
+}
+
+
+/**
+ * @brief Writes the oldest bytes of an output ring and drops them from it.
+ *
+ * The bytes are written with one writev call when possible so a line is never
+ * split between two writes of the shell.
+ *
+ * @param ring The ring to write from.
+ * @param count The number of bytes to write.
+ * @param target The file descriptor to write to.
+ */
+void writeFromRing(outputRing &ring, size_t count, int target)
+{
+    while (count > 0)
+    {
+        // the bytes are in at most two pieces, before and after the wrap around
+        size_t first = min(count, ring.data.size() - ring.head);
+        struct iovec pieces[2];
+        pieces[0].iov_base = ring.data.data() + ring.head;
+        pieces[0].iov_len = first;
+        pieces[1].iov_base = ring.data.data();
+        pieces[1].iov_len = count - first;
+        ssize_t written = writev(target, pieces, count > first ? 2 : 1);
+        if (written <= 0)
+        {
+            // nobody reads the output anymore, drop it
+            written = count;
+        }
+        ring.head = (ring.head + written) % ring.data.size();
+        ring.size -= written;
+        count -= written;
+    }
+}
+
+
+/**
+ * @brief Collects the output of grouped parallel commands.
+ *
+ * Every job has a stdout and a stderr pipe (readFds holds them in job order,
+ * stdout first). They are drained with epoll into one ring buffer per stream
+ * until every writer is done. In "line" mode each complete line is written as
+ * soon as it arrives, streams with data ready at the same time are handled in
+ * job order. In "job" mode the whole output of a job is written once it and
+ * every job before it are done, so the output is always in command order.
+ * A last line without a newline is written when its stream ends.
+ *
+ * @param readFds The read ends of the stdout and stderr pipes of every job.
+ * @param jobCount The number of jobs.
+ */
+void collectGroupedOutput(vector<int> readFds, size_t jobCount)
+{
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+    {
+        perror("error creating epoll instance");
+        exit(1);
+    }
+    for (size_t i = 0; i < readFds.size(); i++)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, readFds[i], &event) == -1)
+        {
+            perror("error watching output pipe");
+            exit(1);
+        }
+    }
+
+    bool byLine = options.groupOutput == "line";
+    vector<outputRing> rings(readFds.size());
+    size_t open = readFds.size();
+    // next job to write in job mode
+    size_t nextJob = 0;
+    char buffer[65536];
+    struct epoll_event events[64];
+
+    while (open > 0)
+    {
+        int ready = epoll_wait(epollFd, events, 64, -1);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("error waiting for output");
+            exit(1);
+        }
+        // handle the streams in job order whatever order epoll returned them in
+        sort(events, events + ready, [](const epoll_event &a, const epoll_event &b)
+        {
+            return a.data.u64 < b.data.u64;
+        });
+        for (int e = 0; e < ready; e++)
+        {
+            size_t stream = events[e].data.u64;
+            outputRing &ring = rings[stream];
+            ssize_t count = read(readFds[stream], buffer, sizeof(buffer));
+            // bytes that were buffered before this read hold no newline
+            size_t oldSize = ring.size;
+            if (count > 0)
+            {
+                appendToRing(ring, buffer, count);
+            }
+            else if (count == 0 || errno != EINTR)
+            {
+                // the stream ended
+                ring.finished = true;
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, readFds[stream], nullptr);
+                close(readFds[stream]);
+                open--;
+            }
+
+            if (byLine)
+            {
+                // everything up to the last newline is made of whole lines
+                size_t complete = 0;
+                for (size_t i = ring.size; i > oldSize; i--)
+                {
+                    if (ring.data[(ring.head + i - 1) % ring.data.size()] == '\n')
+                    {
+                        complete = i;
+                        break;
+                    }
+                }
+                if (ring.finished)
+                {
+                    complete = ring.size;
+                }
+                writeFromRing(ring, complete, stream % 2 == 0 ? 1 : 2);
+            }
+        }
+        // in job mode write every finished job that is next in order
+        while (!byLine && nextJob < jobCount && rings[2 * nextJob].finished && rings[2 * nextJob + 1].finished)
+        {
+            writeFromRing(rings[2 * nextJob], rings[2 * nextJob].size, 1);
+            writeFromRing(rings[2 * nextJob + 1], rings[2 * nextJob + 1].size, 2);
+            // free the memory of the job
+            rings[2 * nextJob] = outputRing();
+            rings[2 * nextJob + 1] = outputRing();
+            nextJob++;
+        }
+    }
+    close(epollFd);
+}
+
+
+/**
+ * @brief Implements the batch-args prefix.
+ *
+ * batch-args [-j N] command [fixed args...] [--] args...
+ *
+ * Runs command as many times as needed so every invocation fits in ARG_MAX
+ * minus the size of the environment. The command and the fixed arguments are
+ * passed to every invocation, the other arguments are split between them. The
+ * fixed arguments are the ones before --, or without --, the options (arguments
+ * starting with -) that follow the command. The invocations run one after the
+ * other, or N at a time with -j. A > redirection is opened once and shared by
+ * every invocation, as are the pipes of the line. Every invocation reads the
+ * < file.
+ *
+ * @param command The parsed batch-args command.
+ * @return Returns 0 if every invocation succeeded, otherwise the status of a
+ *         failed invocation (1 with -j).
+ */
+int runBatchArgs(commandsToExecute command)
+{
+    size_t workerCount = 0;
+    size_t i = 1;
+    // read the options
+    if (i < command.tokens.size() && command.tokens[i] == "-j")
+    {
+        if (i + 1 >= command.tokens.size() || !parseCount(command.tokens[i + 1], workerCount))
+        {
+            perror("Invalid arguments for batch-args\n");
+            if (isFile)
+            {
+                exit(1);
+            }
+            return 1;
+        }
+        i += 2;
+    }
+    if (i >= command.tokens.size())
+    {
+        perror("batch-args needs a command\n");
+        if (isFile)
+        {
+            exit(1);
+        }
+        return 1;
+    }
+
+    // split the fixed part of the command from the arguments to batch
+    vector<string> fixed;
+    vector<string> arguments;
+    vector<string>::iterator separator = find(command.tokens.begin() + i, command.tokens.end(), "--");
+    if (separator != command.tokens.end())
+    {
+        fixed.assign(command.tokens.begin() + i, separator);
+        arguments.assign(separator + 1, command.tokens.end());
+    }
+    else
+    {
+        // the command and the options right after it
+        fixed.push_back(command.tokens[i++]);
+        while (i < command.tokens.size() && command.tokens[i][0] == '-')
+        {
+            fixed.push_back(command.tokens[i++]);
+        }
+        arguments.assign(command.tokens.begin() + i, command.tokens.end());
+    }
+
+    // the kernel also limits the size of a single argument
+    const size_t maxArgumentLength = 32 * sysconf(_SC_PAGESIZE);
+    size_t space = availableArgumentSpace();
+    size_t fixedSize = 0;
+    for (size_t j = 0; j < fixed.size(); j++)
+    {
+        fixedSize += fixed[j].size() + 1 + sizeof(char *);
+    }
+
+    // fill every invocation with as many arguments as fit
+    vector<vector<string>> jobs;
+    size_t next = 0;
+    do
+    {
+        vector<string> tokens = fixed;
+        size_t used = fixedSize;
+        while (next < arguments.size())
+        {
+            size_t cost = arguments[next].size() + 1 + sizeof(char *);
+            if (arguments[next].size() >= maxArgumentLength || fixedSize + cost > space)
+            {
+                errno = E2BIG;
+                perror("batch-args: an argument can never fit");
+                if (isFile)
+                {
+                    exit(1);
+                }
+                return 1;
+            }
+            if (used + cost > space)
+            {
+                break;
+            }
+            tokens.push_back(arguments[next++]);
+            used += cost;
+        }
+        jobs.push_back(tokens);
+    } while (next < arguments.size());
+
+    // a > redirection is truncated once, not by every invocation
+    int outputFd = -1;
+    if (command.redirectOutputToFile)
+    {
+        outputFd = open(command.redirectOutputFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (outputFd == -1)
+        {
+            perror("Error opening output file ");
+            if (isFile)
+            {
+                exit(1);
+            }
+            return 1;
+        }
+    }
+
+    int status = 0;
+    if (workerCount > 0 && jobs.size() > 1)
+    {
+        // the > file, or the pipe after it, or stdout
+        int outputTarget = outputFd != -1 ? outputFd : command.outputFd != -1 ? command.outputFd : 1;
+        status = runJobPool(jobs, workerCount, "batch-args", outputTarget, command) == 0 ? 0 : 1;
+    }
+    else
+    {
+        // run the invocations one after the other with the redirections of the
+        // line, the pipes were given as inputFd / outputFd by executeCommands
+        for (size_t j = 0; j < jobs.size(); j++)
+        {
+            commandsToExecute invocation = command;
+            invocation.tokens = jobs[j];
+            invocation.redirectOutputToFile = false;
+            invocation.isPipeStart = false;
+            invocation.isPipeEnd = false;
+            if (outputFd != -1)
+            {
+                invocation.outputFd = outputFd;
+            }
+            int result = executeCommands({invocation});
+            if (result != 0)
+            {
+                status = result;
+            }
+        }
+    }
+    if (outputFd != -1)
+    {
+        close(outputFd);
+    }
+    return status;
+}
+
+
+/**
+ * @brief Hashes the content of a script line with 64 bit FNV-1a.
+ *
+ * @param line The line to hash.
+ * @return The hash of the line.
+ */
+unsigned long long hashLine(string line)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < line.size(); i++)
+    {
+        hash ^= (unsigned char)line[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+/**
+ * @brief Encodes a string field of a journal record as length:bytes.
+ *
+ * The length prefix lets the field hold spaces and newlines.
+ *
+ * @param field The string to encode.
+ * @return The encoded field.
+ */
+string encodeField(string field)
+{
+    return to_string(field.size()) + ":" + field;
+}
+
+
+/**
+ * @brief Decodes a length:bytes field of a journal record.
+ *
+ * @param text The journal content.
+ * @param loc The position of the field, moved past it.
+ * @param field Updated with the decoded string.
+ * @return Returns false if the field is cut or malformed.
+ */
+bool decodeField(const string &text, size_t &loc, string &field)
+{
+    size_t colon = text.find(':', loc);
+    if (colon == string::npos || colon == loc)
+    {
+        return false;
+    }
+    char *end = nullptr;
+    unsigned long long length = strtoull(text.c_str() + loc, &end, 10);
+    if (end != text.c_str() + colon || colon + 1 + length > text.size())
+    {
+        return false;
+    }
+    field = text.substr(colon + 1, length);
+    loc = colon + 1 + length;
+    return true;
+}
+
+
+/**
+ * @brief Opens the journal given with --journal.
+ *
+ * Every record of the journal is one line:
+ * offset hash status cwd count variable...
+ * where offset is the byte offset of the script line, hash its FNV-1a hash in
+ * hex, status its exit status, cwd the working directory after it ran, and the
+ * count variables are the name=value assignments it made. cwd and the variables
+ * are length:bytes fields.
+ *
+ * Without --resume the journal is emptied. With --resume the completed lines are
+ * loaded, the working directory and the variables of the earlier run are
+ * restored, and a record cut by a crash is dropped from the end of the file.
+ */
+void openJournal()
+{
+    int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    // working directory of the earlier run
+    string cwd;
+    if (options.resume)
+    {
+        // read the records of the earlier run
+        ifstream fin(options.journalFile, ios::binary);
+        string text((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+        // end of the last complete record
+        size_t valid = 0;
+        size_t loc = 0;
+        while (loc < text.size())
+        {
+            char *end = nullptr;
+            long long offset = strtoll(text.c_str() + loc, &end, 10);
+            unsigned long long hash = strtoull(end, &end, 16);
+            strtol(end, &end, 10);
+            loc = end - text.c_str();
+            string recordCwd;
+            if (loc >= text.size() || text[loc] != ' ' || !decodeField(text, ++loc, recordCwd))
+            {
+                break;
+            }
+            unsigned long count = strtoul(text.c_str() + loc, &end, 10);
+            loc = end - text.c_str();
+            vector<string> variables(count);
+            bool complete = true;
+            for (size_t i = 0; i < count && complete; i++)
+            {
+                complete = loc < text.size() && text[loc] == ' ' && decodeField(text, ++loc, variables[i]);
+            }
+            // a record is complete only with its newline
+            if (!complete || loc >= text.size() || text[loc] != '\n')
+            {
+                break;
+            }
+            loc++;
+            valid = loc;
+            completedLines[offset] = hash;
+            cwd = recordCwd;
+            for (size_t i = 0; i < variables.size(); i++)
+            {
+                size_t equals = variables[i].find('=');
+                setenv(variables[i].substr(0, equals).c_str(), variables[i].substr(equals + 1).c_str(), 1);
+            }
+        }
+        // drop a record cut by a crash so the new ones follow complete ones
+        if (valid < text.size() && truncate(options.journalFile.c_str(), valid) != 0)
+        {
+            perror("Error truncating journal");
+            exit(1);
+        }
+    }
+    else
+    {
+        flags |= O_TRUNC;
+    }
+    journalFd = open(options.journalFile.c_str(), flags, 0666);
+    if (journalFd == -1)
+    {
+        perror("Unable to open journal file");
+        exit(1);
+    }
+    // go back to the directory the earlier run was in, once the journal path
+    // no longer matters
+    if (!cwd.empty() && chdir(cwd.c_str()) != 0)
+    {
+        perror("Error changing directory:\n");
+        exit(1);
+    }
+}
+
+
+/**
+ * @brief Appends the record of a completed line to the journal.
+ *
+ * The record is written with a single write and synced to disk before the next
+ * line runs, so a crash loses at most the line that was running.
+ *
+ * @param offset The byte offset of the line in the script.
+ * @param line The content of the line.
+ * @param status The exit status of the line.
+ */
+void writeJournalRecord(long long offset, string line, int status)
+{
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr)
+    {
+        cwd[0] = '\0';
+    }
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", hashLine(line));
+    vector<string> changes;
+    {
+        lock_guard<mutex> guard(environmentLock);
+        changes.swap(environmentChanges);
+    }
+    string record = to_string(offset) + " " + hash + " " + to_string(status) + " "
+                    + encodeField(cwd) + " " + to_string(changes.size());
+    for (size_t i = 0; i < changes.size(); i++)
+    {
+        record += " " + encodeField(changes[i]);
+    }
+    record += "\n";
+
+    size_t written = 0;
+    while (written < record.size())
+    {
+        ssize_t result = write(journalFd, record.data() + written, record.size() - written);
+        if (result == -1)
+        {
+            perror("Error writing journal");
+            exit(1);
+        }
+        written += result;
+    }
+    if (fsync(journalFd) != 0)
+    {
+        perror("Error syncing journal");
+        exit(1);
+    }
+}
+
+
+/**
+ * @brief Describes the commands of a line the way they would be typed.
+ *
+ * @param commands The commands of the line.
+ * @return The commands with their redirections, pipes and & between them.
+ */
+string describePlan(vector<commandsToExecute> commands)
+{
+    string plan;
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        if (commands[i].timeoutMs > 0)
+        {
+            plan += "timeout " + to_string(commands[i].timeoutMs) + "ms ";
+        }
+        for (size_t j = 0; j < commands[i].tokens.size(); j++)
+        {
+            plan += (j > 0 ? " " : "") + commands[i].tokens[j];
+        }
+        if (commands[i].redirectedInputFromFile)
+        {
+            plan += (commands[i].inputCompression.empty() ? " < " : " <z ") + commands[i].redirectedInputFileName;
+        }
+        if (commands[i].redirectOutputToFile)
+        {
+            plan += (commands[i].outputCompression.empty() ? " > " : " >z ") + commands[i].redirectOutputFileName;
+        }
+        if (i + 1 < commands.size())
+        {
+            plan += commands[i].isPipeStart ? " | " : " & ";
+        }
+    }
+    return plan;
+}
+
+
+/**
+ * @brief Reads the line count of a head or tail command.
+ *
+ * Only the forms "head -n N", "head -nN" and "head -N" (same for tail) with no
+ * other arguments are recognized.
+ *
+ * @param command The command to read.
+ * @param count Updated with the line count.
+ * @return Returns true if the command is one of the recognized forms.
+ */
+bool parseLineCount(commandsToExecute command, long &count)
+{
+    vector<string> &tokens = command.tokens;
+    string number;
+    if (tokens.size() == 3 && tokens[1] == "-n")
+    {
+        number = tokens[2];
+    }
+    else if (tokens.size() == 2 && tokens[1].rfind("-n", 0) == 0)
+    {
+        number = tokens[1].substr(2);
+    }
+    else if (tokens.size() == 2 && tokens[1].size() > 1 && tokens[1][0] == '-')
+    {
+        number = tokens[1].substr(1);
+    }
+    // +N and suffixes like 1K change the meaning, leave them alone
+    if (number.empty() || number.find_first_not_of("0123456789") != string::npos)
+    {
+        return false;
+    }
+    count = strtol(number.c_str(), nullptr, 10);
+    return true;
+}
+
+
+/**
+ * @brief Rewrites the pipelines of a line to run fewer processes.
+ *
+ * The rewrites keep the output of the line the same:
+ * - "cat FILE | cmd" or "cat < FILE | cmd" at the start of a pipeline becomes
+ *   "cmd < FILE" when FILE is a regular file, saving a process and a pipe copy.
+ * - a "cat" without arguments in the middle of a pipeline only copies its input
+ *   to its output and is dropped.
+ * - "head -n A | head -n B" becomes "head -n min(A, B)", the same for tail.
+ *
+ * @param commands The commands of the line, updated in place.
+ */
+void optimizePipeline(vector<commandsToExecute> &commands)
+{
+    size_t i = 0;
+    while (i < commands.size())
+    {
+        commandsToExecute &command = commands[i];
+        // every rewrite needs a plain stage that writes to the next one
+        // (a stage with a deadline is kept so the deadline is not lost)
+        bool plainStage = command.isPipeStart && !command.redirectOutputToFile && command.outputFd == -1
+                          && command.timeoutMs == 0;
+        if (!plainStage || i + 1 >= commands.size())
+        {
+            i++;
+            continue;
+        }
+        commandsToExecute &next = commands[i + 1];
+
+        // cat FILE | cmd  or  cat < FILE | cmd  =>  cmd < FILE
+        string source;
+        // cat FILE passes FILE as is, cat <z FILE decompresses it
+        string sourceCompression;
+        if (command.tokens[0] == "cat" && command.tokens.size() == 2 && command.tokens[1][0] != '-'
+            && !command.redirectedInputFromFile)
+        {
+            source = command.tokens[1];
+        }
+        else if (command.tokens[0] == "cat" && command.tokens.size() == 1 && command.redirectedInputFromFile)
+        {
+            source = command.redirectedInputFileName;
+            sourceCompression = command.inputCompression;
+        }
+        struct stat info;
+        if (!source.empty() && !command.isPipeEnd && !next.redirectedInputFromFile
+            && stat(source.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+        {
+            next.redirectedInputFromFile = true;
+            next.redirectedInputFileName = source;
+            next.inputCompression = sourceCompression;
+            next.isPipeEnd = false;
+            commands.erase(commands.begin() + i);
+            continue;
+        }
+
+        // a | cat | b  =>  a | b
+        if (command.tokens.size() == 1 && command.tokens[0] == "cat" && command.isPipeEnd
+            && !command.redirectedInputFromFile)
+        {
+            commands.erase(commands.begin() + i);
+            continue;
+        }
+
+        // head -n A | head -n B  =>  head -n min(A, B), the same for tail
+        long first = 0;
+        long second = 0;
+        if ((command.tokens[0] == "head" || command.tokens[0] == "tail") && next.tokens[0] == command.tokens[0]
+            && !next.redirectedInputFromFile && parseLineCount(command, first) && parseLineCount(next, second))
+        {
+            next.tokens = {command.tokens[0], "-n", to_string(min(first, second))};
+            next.isPipeEnd = command.isPipeEnd;
+            next.redirectedInputFromFile = command.redirectedInputFromFile;
+            next.redirectedInputFileName = command.redirectedInputFileName;
+            next.inputCompression = command.inputCompression;
+            commands.erase(commands.begin() + i);
+            continue;
+        }
+        i++;
+    }
+}
+
+
+/**
+ * @brief Hashes the current state of a watched file or directory.
+ *
+ * A file is hashed by content so an event that did not change it (a touch, a
+ * save without edits) does not trigger a run. A directory is hashed by the
+ * names, sizes and modification times of its entries.
+ *
+ * @param path The file or directory.
+ * @return The FNV-1a hash of the state, 0 if the path does not exist.
+ */
+unsigned long long fingerprintPath(string path)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+    {
+        return 0;
+    }
+    string state;
+    if (S_ISDIR(info.st_mode))
+    {
+        DIR *directory = opendir(path.c_str());
+        if (directory == nullptr)
+        {
+            return 0;
+        }
+        vector<string> entries;
+        struct dirent *entry;
+        while ((entry = readdir(directory)) != nullptr)
+        {
+            struct stat entryInfo;
+            string entryPath = path + "/" + entry->d_name;
+            if (stat(entryPath.c_str(), &entryInfo) == 0)
+            {
+                entries.push_back(string(entry->d_name) + " " + to_string(entryInfo.st_size) + " "
+                                  + to_string(entryInfo.st_mtim.tv_sec) + "." + to_string(entryInfo.st_mtim.tv_nsec));
+            }
+        }
+        closedir(directory);
+        // readdir order is not stable
+        sort(entries.begin(), entries.end());
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            state += entries[i] + "\n";
+        }
+    }
+    else
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return 0;
+        }
+        char buffer[65536];
+        ssize_t count;
+        while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+        {
+            for (ssize_t i = 0; i < count; i++)
+            {
+                hash ^= (unsigned char)buffer[i];
+                hash *= 1099511628211ULL;
+            }
+        }
+        close(fd);
+    }
+    for (size_t i = 0; i < state.size(); i++)
+    {
+        hash ^= (unsigned char)state[i];
+        hash *= 1099511628211ULL;
+    }
+    // keep 0 for missing paths
+    return hash == 0 ? 1 : hash;
+}
+
+
+/**
+ * @brief Implements the on-change builtin.
+ *
+ * on-change [-d MS] [-n RUNS] PATHS... -- pipeline
+ *
+ * Runs the pipeline once, then again every time one of the paths, or a file the
+ * pipeline reads with <, changes. The changes are watched with inotify and a
+ * burst of events is merged until no event came for MS milliseconds (100 by
+ * default). The pipeline only runs again if the content of a watched input is
+ * different from the last run. The time from the first event to the start of the
+ * run is reported on stderr. With -n it stops after RUNS runs, otherwise it runs
+ * until the shell is killed.
+ *
+ * @param input The whole on-change line.
+ * @return The exit status of the last run of the pipeline.
+ */
+int runOnChange(string input)
+{
+    // split the watch list from the pipeline
+    size_t separator = input.find(" -- ");
+    string error;
+    string pipeline = separator == string::npos ? "" : reduceSpacesAndTrim(input.substr(separator + 4), error);
+    if (!error.empty())
+    {
+        perror(error.c_str());
+        if (isFile)
+        {
+            exit(1);
+        }
+        return 1;
+    }
+    istringstream words(input.substr(0, separator));
+    vector<string> arguments;
+    string word;
+    while (words >> word)
+    {
+        arguments.push_back(word);
+    }
+
+    size_t debounce = 100;
+    size_t maxRuns = 0;
+    size_t i = 1;
+    bool valid = !pipeline.empty();
+    while (valid && i < arguments.size() && (arguments[i] == "-d" || arguments[i] == "-n"))
+    {
+        size_t &value = arguments[i] == "-d" ? debounce : maxRuns;
+        valid = i + 1 < arguments.size() && parseCount(arguments[i + 1], value);
+        i += 2;
+    }
+    vector<string> paths(arguments.begin() + min(i, arguments.size()), arguments.end());
+    // the files the pipeline reads with < are inputs too
+    istringstream stages(pipeline);
+    while (stages >> word)
+    {
+        if ((word == "<" || word == "<z") && stages >> word)
+        {
+            paths.push_back(word);
+        }
+    }
+    if (!valid || paths.empty())
+    {
+        perror("Invalid arguments for on-change, use on-change PATHS -- pipeline\n");
+        if (isFile)
+        {
+            exit(1);
+        }
+        return 1;
+    }
+
+    int notifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (notifyFd == -1)
+    {
+        perror("error creating inotify instance");
+        exit(1);
+    }
+    vector<watchedInput> inputs;
+    for (size_t j = 0; j < paths.size(); j++)
+    {
+        watchedInput watched;
+        watched.path = paths[j];
+        struct stat info;
+        watched.isDirectory = stat(paths[j].c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+        string watchPath = paths[j];
+        if (!watched.isDirectory)
+        {
+            // watch the directory of the file for events about its name
+            size_t slash = paths[j].rfind('/');
+            watchPath = slash == string::npos ? "." : (slash == 0 ? "/" : paths[j].substr(0, slash));
+            watched.name = paths[j].substr(slash == string::npos ? 0 : slash + 1);
+        }
+        watched.watch = inotify_add_watch(notifyFd, watchPath.c_str(),
+                                          IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_ATTRIB);
+        if (watched.watch == -1)
+        {
+            perror("Unable to watch path");
+            close(notifyFd);
+            if (isFile)
+            {
+                exit(1);
+            }
+            return 1;
+        }
+        watched.fingerprint = fingerprintPath(paths[j]);
+        inputs.push_back(watched);
+    }
+
+    // the first run happens right away
+    int status = processInput(pipeline);
+    size_t runs = 1;
+    alignas(struct inotify_event) char buffer[65536];
+    while (maxRuns == 0 || runs < maxRuns)
+    {
+        // sleep until something happens to a watched directory
+        struct pollfd waitFor = {notifyFd, POLLIN, 0};
+        if (poll(&waitFor, 1, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("error waiting for changes");
+            break;
+        }
+        chrono::steady_clock::time_point trigger = chrono::steady_clock::now();
+
+        // read events until none came for the debounce window
+        bool relevant = false;
+        do
+        {
+            ssize_t count;
+            while ((count = read(notifyFd, buffer, sizeof(buffer))) > 0)
+            {
+                for (char *loc = buffer; loc < buffer + count; )
+                {
+                    struct inotify_event *event = (struct inotify_event *)loc;
+                    for (size_t j = 0; j < inputs.size(); j++)
+                    {
+                        if (event->wd == inputs[j].watch
+                            && (inputs[j].isDirectory || (event->len > 0 && inputs[j].name == event->name)))
+                        {
+                            relevant = true;
+                        }
+                    }
+                    loc += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        } while (poll(&waitFor, 1, debounce) > 0);
+        if (!relevant)
+        {
+            continue;
+        }
+
+        // run only if an input really changed since the last run
+        bool changed = false;
+        for (size_t j = 0; j < inputs.size(); j++)
+        {
+            unsigned long long fingerprint = fingerprintPath(inputs[j].path);
+            if (fingerprint != inputs[j].fingerprint)
+            {
+                inputs[j].fingerprint = fingerprint;
+                changed = true;
+            }
+        }
+        if (!changed)
+        {
+            cerr << "on-change: inputs unchanged, run skipped" << endl;
+            continue;
+        }
+        double latency = chrono::duration<double, milli>(chrono::steady_clock::now() - trigger).count();
+        cerr << "on-change: run " << runs + 1 << " started " << latency << " ms after the change ("
+             << debounce << " ms debounce)" << endl;
+        status = processInput(pipeline);
+        runs++;
+    }
+    close(notifyFd);
+    return status;
+}
+
+
+/**
+ * @brief Finds whether a redirected file is compressed by the shell.
+ *
+ * Only the >z and <z operators go through the shell, plain < and > leave the
+ * bytes alone so zcat < file.gz and gzip -c > file.gz keep working.
+ *
+ * @param fileName The redirected file.
+ * @param compressed True for the >z and <z operators.
+ * @return "zst" for .zst files, "gz" for any other file, empty without >z or <z.
+ */
+string compressionFormat(string fileName, bool compressed)
+{
+    if (!compressed)
+    {
+        return "";
+    }
+    if (fileName.size() > 4 && fileName.compare(fileName.size() - 4, 4, ".zst") == 0)
+    {
+        return "zst";
+    }
+    return "gz";
+}
+
+
+/**
+ * @brief Compresses one block of output into a standalone gzip member or zstd frame.
+ *
+ * Concatenated gzip members and zstd frames are valid files for gunzip and zstd,
+ * so every block can be compressed on its own thread.
+ *
+ * @param chunk The block to compress.
+ * @param format "gz" or "zst".
+ * @return The compressed block, empty on error.
+ */
+string compressChunk(const string &chunk, string format)
+{
+    string compressed;
+#ifdef MISH_ZSTD
+    if (format == "zst")
+    {
+        compressed.resize(ZSTD_compressBound(chunk.size()));
+        size_t size = ZSTD_compress(&compressed[0], compressed.size(), chunk.data(), chunk.size(), 3);
+        compressed.resize(ZSTD_isError(size) ? 0 : size);
+        return compressed;
+    }
+#endif
+    if (format != "gz")
+    {
+        return compressed;
+    }
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 15 + 16 writes a gzip header and trailer
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return compressed;
+    }
+    compressed.resize(deflateBound(&stream, chunk.size()));
+    stream.next_in = (Bytef *)chunk.data();
+    stream.avail_in = chunk.size();
+    stream.next_out = (Bytef *)&compressed[0];
+    stream.avail_out = compressed.size();
+    int result = deflate(&stream, Z_FINISH);
+    compressed.resize(result == Z_STREAM_END ? stream.total_out : 0);
+    deflateEnd(&stream);
+    return compressed;
+}
+
+
+/**
+ * @brief Reports the size and speed of a compression stage on stderr.
+ *
+ * @param name "compress" or "decompress".
+ * @param fileName The compressed file.
+ * @param from The bytes read by the stage.
+ * @param to The bytes written by the stage.
+ * @param start When the stage started.
+ */
+void reportTransfer(string name, string fileName, size_t from, size_t to, chrono::steady_clock::time_point start)
+{
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    // the speed is measured on the uncompressed side
+    size_t plain = name == "compress" ? from : to;
+    cerr << name << ": " << fileName << " " << from << " -> " << to << " bytes in " << seconds << " s ("
+         << (seconds > 0 ? plain / seconds / 1048576 : 0) << " MiB/s)";
+    if (name == "compress")
+    {
+        cerr << ", " << (from > to ? from - to : 0) << " bytes saved on disk";
+    }
+    cerr << endl;
+}
+
+
+/**
+ * @brief Compresses everything read from a pipe into a file.
+ *
+ * The input is cut in 1 MiB blocks. One block per CPU is compressed in parallel
+ * while the next blocks are read, then the blocks are written in order. Both file
+ * descriptors are closed at the end.
+ *
+ * @param inputFd The read end of the pipe the command writes to.
+ * @param outputFd The compressed file.
+ * @param format "gz" or "zst".
+ * @param fileName The name of the file, used in the report.
+ */
+void compressStream(int inputFd, int outputFd, string format, string fileName)
+{
+    const size_t chunkSize = 1 << 20;
+    size_t workerCount = max(1u, thread::hardware_concurrency());
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t totalIn = 0;
+    size_t totalOut = 0;
+    bool ended = false;
+    // a block could not be compressed or written
+    bool failed = false;
+    bool writeError = false;
+
+    // reads the next blocks, up to one per worker
+    auto readBatch = [&]()
+    {
+        vector<string> chunks;
+        while (chunks.size() < workerCount && !ended)
+        {
+            string chunk(chunkSize, '\0');
+            size_t filled = 0;
+            while (filled < chunkSize)
+            {
+                ssize_t count = read(inputFd, &chunk[filled], chunkSize - filled);
+                if (count > 0)
+                {
+                    filled += count;
+                }
+                else if (count == -1 && errno == EINTR)
+                {
+                    continue;
+                }
+                else
+                {
+                    ended = true;
+                    break;
+                }
+            }
+            chunk.resize(filled);
+            if (filled > 0)
+            {
+                totalIn += filled;
+                chunks.push_back(chunk);
+            }
+        }
+        return chunks;
+    };
+
+    vector<string> chunks = readBatch();
+    // an empty output still makes a valid compressed file
+    if (chunks.empty())
+    {
+        chunks.push_back("");
+    }
+    while (!chunks.empty())
+    {
+        vector<string> compressed(chunks.size());
+        vector<thread> workers;
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            workers.emplace_back([&, i]()
+            {
+                compressed[i] = compressChunk(chunks[i], format);
+            });
+        }
+        // read the next blocks while these are compressed
+        vector<string> next = readBatch();
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i].join();
+        }
+        for (size_t i = 0; i < compressed.size() && !failed; i++)
+        {
+            if (compressed[i].empty())
+            {
+                failed = true;
+                break;
+            }
+            size_t written = 0;
+            while (written < compressed[i].size())
+            {
+                ssize_t result = write(outputFd, compressed[i].data() + written, compressed[i].size() - written);
+                if (result == -1)
+                {
+                    failed = true;
+                    writeError = true;
+                    break;
+                }
+                written += result;
+            }
+            totalOut += written;
+        }
+        chunks = next;
+    }
+    if (writeError)
+    {
+        perror("Error writing compressed file");
+    }
+    else if (failed)
+    {
+#ifndef MISH_ZSTD
+        if (format == "zst")
+        {
+            cerr << "compress: " << fileName << ": mish was built without zstd support" << endl;
+        }
+        else
+#endif
+        cerr << "compress: " << fileName << ": compression failed" << endl;
+    }
+    close(inputFd);
+    close(outputFd);
+    if (!failed)
+    {
+        reportTransfer("compress", fileName, totalIn, totalOut, start);
+    }
+}
+
+
+/**
+ * @brief Decompresses a file into a pipe.
+ *
+ * gzip files may hold several members (as written by compressStream) and zstd
+ * files several frames, they are decompressed one after the other. The data is
+ * decompressed while the command reads the pipe. Both file descriptors are
+ * closed at the end.
+ *
+ * @param inputFd The compressed file.
+ * @param outputFd The write end of the pipe the command reads.
+ * @param format "gz" or "zst".
+ * @param fileName The name of the file, used in the report.
+ */
+void decompressStream(int inputFd, int outputFd, string format, string fileName)
+{
+    const size_t chunkSize = 1 << 20;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t totalIn = 0;
+    size_t totalOut = 0;
+    vector<char> input(chunkSize);
+    vector<char> output(chunkSize);
+    bool corrupt = false;
+    // the command stopped reading
+    bool closed = false;
+
+    // writes decompressed bytes to the pipe
+    auto writeOutput = [&](size_t count)
+    {
+        size_t written = 0;
+        while (written < count && !closed)
+        {
+            ssize_t result = write(outputFd, output.data() + written, count - written);
+            if (result == -1 && errno != EINTR)
+            {
+                closed = true;
+            }
+            else if (result > 0)
+            {
+                written += result;
+            }
+        }
+        totalOut += written;
+    };
+
+#ifdef MISH_ZSTD
+    if (format == "zst")
+    {
+        ZSTD_DStream *stream = ZSTD_createDStream();
+        ZSTD_initDStream(stream);
+        ssize_t count;
+        while (!corrupt && !closed && (count = read(inputFd, input.data(), chunkSize)) > 0)
+        {
+            totalIn += count;
+            ZSTD_inBuffer in = {input.data(), (size_t)count, 0};
+            while (in.pos < in.size && !closed)
+            {
+                ZSTD_outBuffer out = {output.data(), chunkSize, 0};
+                if (ZSTD_isError(ZSTD_decompressStream(stream, &out, &in)))
+                {
+                    corrupt = true;
+                    break;
+                }
+                writeOutput(out.pos);
+            }
+        }
+        ZSTD_freeDStream(stream);
+    }
+#endif
+    if (format == "gz")
+    {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        // 15 + 32 accepts both gzip and zlib headers
+        corrupt = inflateInit2(&stream, 15 + 32) != Z_OK;
+        ssize_t count;
+        while (!corrupt && !closed && (count = read(inputFd, input.data(), chunkSize)) > 0)
+        {
+            totalIn += count;
+            stream.next_in = (Bytef *)input.data();
+            stream.avail_in = count;
+            while (stream.avail_in > 0 && !closed)
+            {
+                stream.next_out = (Bytef *)output.data();
+                stream.avail_out = chunkSize;
+                int result = inflate(&stream, Z_NO_FLUSH);
+                if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+                {
+                    corrupt = true;
+                    break;
+                }
+                writeOutput(chunkSize - stream.avail_out);
+                // another member may follow
+                if (result == Z_STREAM_END)
+                {
+                    inflateReset(&stream);
+                }
+            }
+        }
+        inflateEnd(&stream);
+    }
+#ifndef MISH_ZSTD
+    if (format == "zst")
+    {
+        cerr << "decompress: " << fileName << ": mish was built without zstd support" << endl;
+        corrupt = true;
+    }
+    else
+#endif
+    if (corrupt)
+    {
+        cerr << "decompress: " << fileName << ": invalid compressed data" << endl;
+    }
+    close(inputFd);
+    close(outputFd);
+    if (!corrupt)
+    {
+        reportTransfer("decompress", fileName, totalIn, totalOut, start);
+    }
+}
+
+
+/**
+ * @brief Adds a plan to a planQueue, waiting while the queue is full.
+ *
+ * Only one thread may push to a queue.
+ *
+ * @param queue The queue.
+ * @param plan The plan to add.
+ */
+void pushPlan(planQueue &queue, executionPlan plan)
+{
+    size_t tail = queue.tail.load(memory_order_relaxed);
+    if (tail - queue.head.load(memory_order_acquire) == queue.slots.size())
+    {
+        unique_lock<mutex> guard(queue.lock);
+        queue.changed.wait(guard, [&]()
+        {
+            return queue.stop || tail - queue.head.load(memory_order_acquire) < queue.slots.size();
+        });
+        // nobody takes plans anymore
+        if (queue.stop)
+        {
+            return;
+        }
+    }
+    queue.slots[tail % queue.slots.size()] = move(plan);
+    {
+        lock_guard<mutex> guard(queue.lock);
+        queue.tail.store(tail + 1, memory_order_release);
+    }
+    queue.changed.notify_all();
+}
+
+
+/**
+ * @brief Takes the oldest plan of a planQueue, waiting while the queue is empty.
+ *
+ * Only one thread may pop from a queue.
+ *
+ * @param queue The queue.
+ * @return The oldest plan.
+ */
+executionPlan popPlan(planQueue &queue)
+{
+    size_t head = queue.head.load(memory_order_relaxed);
+    if (queue.tail.load(memory_order_acquire) == head)
+    {
+        unique_lock<mutex> guard(queue.lock);
+        queue.changed.wait(guard, [&]()
+        {
+            return queue.tail.load(memory_order_acquire) != head;
+        });
+    }
+    executionPlan plan = move(queue.slots[head % queue.slots.size()]);
+    {
+        lock_guard<mutex> guard(queue.lock);
+        queue.head.store(head + 1, memory_order_release);
+    }
+    queue.changed.notify_all();
+    return plan;
+}
+
+
+/**
+ * @brief Recognizes the start of a function definition, name() {
+ *
+ * @param line The line to check.
+ * @param name Updated with the name of the function.
+ * @param rest Updated with what follows the {.
+ * @return Returns true if the line starts a function definition.
+ */
+bool parseFunctionHeader(string line, string &name, string &rest)
+{
+    size_t loc = line.find_first_not_of(' ');
+    if (loc == string::npos || !(isalpha(line[loc]) || line[loc] == '_'))
+    {
+        return false;
+    }
+    // the name is made of letters, digits and _
+    size_t end = loc;
+    while (end < line.size() && (isalnum(line[end]) || line[end] == '_'))
+    {
+        end++;
+    }
+    name = line.substr(loc, end - loc);
+    loc = line.find_first_not_of(' ', end);
+    if (loc == string::npos || line.compare(loc, 2, "()") != 0)
+    {
+        return false;
+    }
+    loc = line.find_first_not_of(' ', loc + 2);
+    if (loc == string::npos || line[loc] != '{')
+    {
+        return false;
+    }
+    rest = line.substr(loc + 1);
+    return true;
+}
+
+
+/**
+ * @brief Checks whether a line starts a function definition that goes on to
+ * the next lines.
+ *
+ * @param line The line to check.
+ * @return Returns true if the line starts a definition without closing it.
+ */
+bool opensFunction(string line)
+{
+    string name;
+    string rest;
+    if (!parseFunctionHeader(line, name, rest))
+    {
+        return false;
+    }
+    size_t last = rest.find_last_not_of(' ');
+    return last == string::npos || rest[last] != '}';
+}
+
+
+/**
+ * @brief Reads the lines of a function definition up to the line with }.
+ *
+ * The lines are joined with ; so the definition becomes a single line.
+ *
+ * @param in The stream the definition is read from.
+ * @param firstLine The line with name() {.
+ * @param prompt True to prompt for every line, in interactive mode.
+ * @return The whole definition on one line.
+ */
+string readFunctionBody(istream &in, string firstLine, bool prompt)
+{
+    string definition = firstLine;
+    string line;
+    if (prompt)
+    {
+        cout << "> ";
+    }
+    while (getline(in, line))
+    {
+        size_t start = line.find_first_not_of(' ');
+        // the closing line
+        if (start != string::npos && line.compare(start, string::npos, "}") == 0)
+        {
+            break;
+        }
+        if (start != string::npos)
+        {
+            definition += " ; " + line.substr(start);
+        }
+        if (prompt)
+        {
+            cout << "> ";
+        }
+    }
+    return definition + " }";
+}
+
+
+/**
+ * @brief Parses the body of a function definition into plans.
+ *
+ * The commands of the body are separated by ;. Each one is parsed once here and
+ * the plans are kept in the function table when the definition runs, so calls
+ * never parse the body again.
+ *
+ * @param name The name of the function.
+ * @param rest What follows the { of the definition, up to the closing }.
+ * @param plan Updated with the function, or the error of the definition.
+ */
+void parseFunction(string name, string rest, executionPlan &plan)
+{
+    size_t last = rest.find_last_not_of(' ');
+    if (last == string::npos || rest[last] != '}')
+    {
+        plan.error = "invalid function definition, missing } \n";
+        return;
+    }
+    rest = rest.substr(0, last);
+    plan.functionName = name;
+    size_t start = 0;
+    while (start <= rest.size())
+    {
+        size_t end = rest.find(';', start);
+        if (end == string::npos)
+        {
+            end = rest.size();
+        }
+        string command = rest.substr(start, end - start);
+        start = end + 1;
+        if (command.find_first_not_of(' ') == string::npos)
+        {
+            continue;
+        }
+        executionPlan commandPlan;
+        parseInput(command, commandPlan);
+        if (!commandPlan.error.empty() || !commandPlan.functionName.empty())
+        {
+            plan.error = commandPlan.error.empty() ? "functions can't be defined in functions \n" : commandPlan.error;
+            return;
+        }
+        plan.functionBody.push_back(commandPlan);
+    }
+}
+
+
+/**
+ * @brief Replaces the positional arguments in a token of a function body.
+ *
+ * $1 to $9 and ${N} are replaced by the arguments of the call ("" when missing),
+ * $# by their count. A token that is exactly $@ becomes one token per argument.
+ *
+ * @param token The token to expand.
+ * @param expanded The expanded tokens are appended to it.
+ */
+void expandPositionalToken(string token, vector<string> &expanded)
+{
+    // the name of the function comes first
+    vector<string> &arguments = positionalArguments.back();
+    if (token == "$@")
+    {
+        expanded.insert(expanded.end(), arguments.begin() + 1, arguments.end());
+        return;
+    }
+    string result;
+    for (size_t i = 0; i < token.size(); i++)
+    {
+        if (token[i] != '$' || i + 1 >= token.size())
+        {
+            result += token[i];
+            continue;
+        }
+        size_t index = 0;
+        size_t end = i + 1;
+        if (isdigit(token[i + 1]))
+        {
+            // a single digit, like sh
+            index = token[i + 1] - '0';
+            end = i + 2;
+        }
+        else if (token[i + 1] == '{' && token.find('}', i) != string::npos)
+        {
+            end = token.find('}', i);
+            string digits = token.substr(i + 2, end - i - 2);
+            if (digits.empty() || digits.find_first_not_of("0123456789") != string::npos)
+            {
+                result += token[i];
+                continue;
+            }
+            index = strtoul(digits.c_str(), nullptr, 10);
+            end++;
+        }
+        else if (token[i + 1] == '#')
+        {
+            result += to_string(arguments.size() - 1);
+            i++;
+            continue;
+        }
+        else
+        {
+            result += token[i];
+            continue;
+        }
+        // $0 is the name of the function
+        if (index == 0)
+        {
+            result += arguments[0];
+        }
+        else if (index < arguments.size())
+        {
+            result += arguments[index];
+        }
+        i = end - 1;
+    }
+    expanded.push_back(result);
+}
+
+
+/**
+ * @brief Replaces the positional arguments in the commands of a plan.
+ *
+ * The tokens, the redirected files and the $(...) commands of the plan are
+ * expanded with the arguments of the innermost function call.
+ *
+ * @param plan The plan to expand, updated in place.
+ */
+void expandPositionalPlan(executionPlan &plan)
+{
+    for (size_t j = 0; j < plan.commands.size(); j++)
+    {
+        commandsToExecute &command = plan.commands[j];
+        vector<string> expanded;
+        for (size_t k = 0; k < command.tokens.size(); k++)
+        {
+            expandPositionalToken(command.tokens[k], expanded);
+        }
+        // an empty $@ may leave no command at all
+        if (expanded.empty())
+        {
+            expanded.push_back("true");
+        }
+        command.tokens = expanded;
+        vector<string> outputFile;
+        vector<string> inputFile;
+        expandPositionalToken(command.redirectOutputFileName, outputFile);
+        expandPositionalToken(command.redirectedInputFileName, inputFile);
+        command.redirectOutputFileName = outputFile.empty() ? "" : outputFile[0];
+        command.redirectedInputFileName = inputFile.empty() ? "" : inputFile[0];
+    }
+    for (size_t j = 0; j < plan.substitutions.size(); j++)
+    {
+        expandPositionalPlan(plan.substitutions[j]);
+    }
+    for (size_t j = 0; j < plan.processSubstitutions.size(); j++)
+    {
+        expandPositionalPlan(plan.processSubstitutions[j]);
+    }
+}
+
+
+/**
+ * @brief Calls a function with the pipes and redirections of its command.
+ *
+ * The body runs in the shell, so its commands get the input and output of the
+ * call through stdinOverrideFd and stdoutOverrideFd while it runs.
+ *
+ * @param call The command calling the function, its pipes given as inputFd and
+ *        outputFd by executeCommands.
+ * @return The exit status of the last command of the body, 1 on error.
+ */
+int runFunctionCall(commandsToExecute call)
+{
+    int outputFile = -1;
+    int inputFile = -1;
+    if (call.redirectOutputToFile)
+    {
+        outputFile = open(call.redirectOutputFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (outputFile == -1)
+        {
+            perror("Error opening output file ");
+            if (isFile)
+            {
+                exit(1);
+            }
+            return 1;
+        }
+    }
+    if (call.redirectedInputFromFile)
+    {
+        inputFile = open(call.redirectedInputFileName.c_str(), O_RDONLY | O_CLOEXEC);
+        if (inputFile == -1)
+        {
+            perror("Error opening input file ");
+            if (outputFile != -1)
+            {
+                close(outputFile);
+            }
+            if (isFile)
+            {
+                exit(1);
+            }
+            return 1;
+        }
+    }
+    // nested calls put the outer redirections back
+    int previousOutput = stdoutOverrideFd;
+    int previousInput = stdinOverrideFd;
+    if (outputFile != -1 || call.outputFd != -1)
+    {
+        stdoutOverrideFd = outputFile != -1 ? outputFile : call.outputFd;
+    }
+    if (inputFile != -1 || call.inputFd != -1)
+    {
+        stdinOverrideFd = inputFile != -1 ? inputFile : call.inputFd;
+    }
+    cout.flush();
+    int status = callFunction(call.tokens);
+    stdoutOverrideFd = previousOutput;
+    stdinOverrideFd = previousInput;
+    if (outputFile != -1)
+    {
+        close(outputFile);
+    }
+    if (inputFile != -1)
+    {
+        close(inputFile);
+    }
+    return status == -1 ? 1 : status;
+}
+
+
+/**
+ * @brief Calls a function defined in the shell.
+ *
+ * The parsed body runs in the shell process, command by command, with the
+ * arguments of the call as $1 to $N. Only external commands are forked.
+ *
+ * @param tokens The name of the function and its arguments.
+ * @return The exit status of the last command of the body, -1 on error.
+ */
+int callFunction(vector<string> tokens)
+{
+    // stop runaway recursion before it exhausts the stack
+    if (positionalArguments.size() >= 100)
+    {
+        perror("function calls nested too deep\n");
+        if (isFile)
+        {
+            exit(1);
+        }
+        return -1;
+    }
+    // copy the body, the function may redefine itself while it runs
+    vector<executionPlan> body = functions[tokens[0]];
+    // $@ and $# leave out the name of the function
+    positionalArguments.push_back(tokens);
+    int status = 0;
+    for (size_t i = 0; i < body.size(); i++)
+    {
+        executionPlan plan = body[i];
+        expandPositionalPlan(plan);
+        status = runPlan(plan);
+    }
+    positionalArguments.pop_back();
+    return status;
+}
+
+
+/**
+ * @brief Parses the $(...), <(...) and >(...) commands of a line and replaces
+ * them with placeholders.
+ *
+ * Each $(...) command is parsed once into plan.substitutions and replaced in
+ * the line by $\x01N\x01, where N is its index. <(...) and >(...) go to
+ * plan.processSubstitutions and are replaced by $\x02N\x02. Parentheses nest,
+ * so a command may hold other ones, they are parsed with the command holding
+ * them.
+ *
+ * @param input The line.
+ * @param plan Updated with the parsed commands, or the error.
+ * @return The line with the placeholders.
+ */
+string extractSubstitutions(string input, executionPlan &plan)
+{
+    string result;
+    size_t i = 0;
+    while (i < input.size())
+    {
+        bool isProcess = input.compare(i, 2, "<(") == 0 || input.compare(i, 2, ">(") == 0;
+        if (input.compare(i, 2, "$(") != 0 && !isProcess)
+        {
+            result += input[i++];
+            continue;
+        }
+        // find the matching )
+        size_t depth = 1;
+        size_t end = i + 2;
+        while (end < input.size() && depth > 0)
+        {
+            if (input[end] == '(')
+            {
+                depth++;
+            }
+            else if (input[end] == ')')
+            {
+                depth--;
+            }
+            end++;
+        }
+        if (depth > 0)
+        {
+            plan.error = "invalid command substitution, missing ) \n";
+            return "";
+        }
+        executionPlan inner;
+        parseInput(input.substr(i + 2, end - i - 3), inner);
+        if (!inner.error.empty())
+        {
+            plan.error = inner.error;
+            return "";
+        }
+        if (isProcess)
+        {
+            result += "$\x02" + to_string(plan.processSubstitutions.size()) + "\x02";
+            plan.processSubstitutions.push_back(inner);
+            plan.processDirections += input[i];
+        }
+        else
+        {
+            result += "$\x01" + to_string(plan.substitutions.size()) + "\x01";
+            plan.substitutions.push_back(inner);
+        }
+        i = end;
+    }
+    return result;
+}
+
+
+/**
+ * @brief Runs a parsed command and captures its output.
+ *
+ * The command runs through runPlan in the shell, builtins without forking.
+ * Everything it would write to the shell's stdout goes to a 1 MiB pipe that a
+ * thread reads into a growing buffer while the command runs. Once the output
+ * reaches --subst-limit the pipe is closed so the command can't fill the memory
+ * of the shell.
+ *
+ * @param inner The parsed command.
+ * @param output Updated with the output, without its trailing newlines.
+ * @return Returns false if the output went over the limit.
+ */
+bool captureOutput(executionPlan inner, string &output)
+{
+    int temp[2];
+    if (pipe2(temp, O_CLOEXEC) == -1)
+    {
+        perror("error creating a pipe");
+        exit(1);
+    }
+    // fewer wakeups of the reader for big outputs, the size is only a hint
+    fcntl(temp[1], F_SETPIPE_SZ, 1 << 20);
+
+    bool overLimit = false;
+    thread reader([&]()
+    {
+        char buffer[65536];
+        ssize_t count;
+        while ((count = read(temp[0], buffer, sizeof(buffer))) != 0)
+        {
+            if (count == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            if (output.size() + count > options.substitutionLimit)
+            {
+                overLimit = true;
+                break;
+            }
+            output.append(buffer, count);
+        }
+        // the command gets SIGPIPE if it writes more
+        close(temp[0]);
+    });
+
+    // nested captures put the outer one back
+    int previous = stdoutOverrideFd;
+    stdoutOverrideFd = temp[1];
+    cout.flush();
+    runPlan(inner);
+    stdoutOverrideFd = previous;
+    close(temp[1]);
+    reader.join();
+
+    while (!output.empty() && output.back() == '\n')
+    {
+        output.pop_back();
+    }
+    return !overLimit;
+}
+
+
+/**
+ * @brief Replaces the placeholders of a token with the output of their commands.
+ *
+ * The output is split into words on spaces, tabs and newlines. The first word
+ * joins the text before the placeholder and the last word the text after it,
+ * the others become tokens of their own. Every command runs once, the first
+ * time its placeholder is found.
+ *
+ * @param token The token to expand.
+ * @param plan The plan holding the parsed commands.
+ * @param outputs The outputs of the commands that ran.
+ * @param done Which commands ran.
+ * @param expanded The expanded tokens are appended to it.
+ * @return Returns false if an output went over the limit.
+ */
+bool expandSubstitutionToken(string token, executionPlan &plan, vector<string> &outputs, vector<bool> &done, vector<string> &expanded)
+{
+    string word;
+    // true when word holds text, even empty text from the token
+    bool inWord = false;
+    size_t i = 0;
+    while (i < token.size())
+    {
+        size_t end = token.find('\x01', i + 2);
+        if (token.compare(i, 2, "$\x01") != 0 || end == string::npos)
+        {
+            word += token[i++];
+            inWord = true;
+            continue;
+        }
+        size_t index = strtoul(token.c_str() + i + 2, nullptr, 10);
+        i = end + 1;
+        if (!done[index])
+        {
+            done[index] = true;
+            if (!captureOutput(plan.substitutions[index], outputs[index]))
+            {
+                return false;
+            }
+        }
+        // split the output into words
+        const string &output = outputs[index];
+        for (size_t j = 0; j < output.size(); j++)
+        {
+            if (output[j] == ' ' || output[j] == '\t' || output[j] == '\n')
+            {
+                if (inWord)
+                {
+                    expanded.push_back(word);
+                    word.clear();
+                    inWord = false;
+                }
+            }
+            else
+            {
+                word += output[j];
+                inWord = true;
+            }
+        }
+    }
+    if (inWord)
+    {
+        expanded.push_back(word);
+    }
+    return true;
+}
+
+
+/**
+ * @brief Runs the $(...) commands of a plan and puts their output in its tokens.
+ *
+ * The redirected files get the output with its words joined by spaces.
+ *
+ * @param plan The plan to expand, updated in place.
+ * @return Returns false if an output went over --subst-limit.
+ */
+bool expandSubstitutions(executionPlan &plan)
+{
+    vector<string> outputs(plan.substitutions.size());
+    vector<bool> done(plan.substitutions.size(), false);
+    bool valid = true;
+    for (size_t j = 0; j < plan.commands.size() && valid; j++)
+    {
+        commandsToExecute &command = plan.commands[j];
+        vector<string> expanded;
+        for (size_t k = 0; k < command.tokens.size() && valid; k++)
+        {
+            valid = expandSubstitutionToken(command.tokens[k], plan, outputs, done, expanded);
+        }
+        // an empty output may leave no command at all
+        if (expanded.empty())
+        {
+            expanded.push_back("true");
+        }
+        command.tokens = expanded;
+        string *fileNames[2] = {&command.redirectOutputFileName, &command.redirectedInputFileName};
+        for (int k = 0; k < 2 && valid; k++)
+        {
+            vector<string> words;
+            valid = expandSubstitutionToken(*fileNames[k], plan, outputs, done, words);
+            string joined;
+            for (size_t w = 0; w < words.size(); w++)
+            {
+                joined += (w > 0 ? " " : "") + words[w];
+            }
+            *fileNames[k] = joined;
+        }
+    }
+    if (!valid)
+    {
+        errno = EFBIG;
+        perror("command substitution output over --subst-limit");
+        if (isFile)
+        {
+            exit(1);
+        }
+    }
+    return valid;
+}
+
+
+/**
+ * @brief Reads a duration like 1.5, 300ms, 10s, 2m or 1h.
+ *
+ * A number without a unit is in seconds.
+ *
+ * @param text The duration.
+ * @param milliseconds Updated with the duration in milliseconds.
+ * @return Returns false if the text is not a positive duration.
+ */
+bool parseDuration(string text, long long &milliseconds)
+{
+    size_t unit = text.find_first_not_of("0123456789.");
+    string number = text.substr(0, unit);
+    string suffix = unit == string::npos ? "" : text.substr(unit);
+    if (number.empty() || number.find_first_of("0123456789") == string::npos
+        || count(number.begin(), number.end(), '.') > 1)
+    {
+        return false;
+    }
+    double scale = 0;
+    if (suffix.empty() || suffix == "s")
+    {
+        scale = 1000;
+    }
+    else if (suffix == "ms")
+    {
+        scale = 1;
+    }
+    else if (suffix == "m")
+    {
+        scale = 60 * 1000;
+    }
+    else if (suffix == "h")
+    {
+        scale = 60 * 60 * 1000;
+    }
+    else
+    {
+        return false;
+    }
+    double value = strtod(number.c_str(), nullptr) * scale;
+    // a deadline under a millisecond would be no deadline at all
+    if (value < 1 || value > 1e15)
+    {
+        return false;
+    }
+    milliseconds = (long long)value;
+    return true;
+}
+
+
+/**
+ * @brief Reads the timeout DUR prefix of a command.
+ *
+ * "timeout DUR cmd args..." runs cmd with a deadline of DUR (see
+ * parseDuration), the prefix is removed from the tokens. On parallel,
+ * batch-args and function calls the deadline bounds every command they start,
+ * see stageDeadlineMs. Any other form, like
+ * "timeout -k 1 5 cmd", is left to the timeout program.
+ *
+ * @param command The command, updated in place.
+ */
+void parseTimeoutPrefix(commandsToExecute &command)
+{
+    if (command.tokens.empty() || command.tokens[0] != "timeout")
+    {
+        return;
+    }
+    // options, or a duration only known when the line runs ($1, $(...)), are
+    // left to the timeout program
+    long long timeoutMs = 0;
+    if (command.tokens.size() < 3 || !parseDuration(command.tokens[1], timeoutMs))
+    {
+        return;
+    }
+    command.timeoutMs = timeoutMs;
+    command.tokens.erase(command.tokens.begin(), command.tokens.begin() + 2);
+}
+
+
+/**
+ * @brief Sends a signal to a command past its deadline.
+ *
+ * The whole process group gets it when the command leads one, otherwise only
+ * the command (it shares the shell's group when stdin is a terminal).
+ *
+ * @param pid The command, not reaped yet.
+ * @param signal The signal.
+ */
+void signalCommand(int pid, int signal)
+{
+    if (killpg(pid, signal) == -1)
+    {
+        kill(pid, signal);
+    }
+}
+
+
+/**
+ * @brief Waits for the children of a line, killing the ones past their deadline.
+ *
+ * Every child is waited on through a pidfd, all of them in one poll whose
+ * timeout is the nearest deadline. A child past its deadline gets SIGTERM on its
+ * process group (or on itself when it has none, see signalCommand), then
+ * SIGKILL --kill-after later if it is still running. A
+ * timed out command has the status 124 and is reported on stderr. Kernels
+ * without pidfd_open fall back to checking the children every 10 ms. With
+ * --record every child is logged when it is reaped. With --mem-budget the RSS
+ * of every child is sampled every 50 ms and its peak is kept for the next
+ * launches of the same command.
+ *
+ * @param commands The commands of the line.
+ * @param pids The pid of every command, -1 for the ones not forked.
+ * @param deadlines The deadline of every command in milliseconds of the steady
+ *        clock, 0 for none.
+ * @param startTimes When every command was forked.
+ * @param stages The state of every command: 0 running, 1 sent SIGTERM, 2 sent
+ *        SIGKILL, 3 reaped or not forked. Updated in place.
+ * @param statuses Updated with the exit status of every reaped command.
+ * @param maxWaitMs -1 to wait for every child, otherwise return once a child
+ *        was reaped or after maxWaitMs milliseconds.
+ */
+void waitWithDeadlines(vector<commandsToExecute> &commands, vector<int> &pids, vector<long long> &deadlines,
+                       vector<chrono::steady_clock::time_point> &startTimes, vector<int> &stages,
+                       vector<int> &statuses, long long maxWaitMs)
+{
+    size_t count = commands.size();
+    vector<int> pidFds(count, -1);
+    bool fallback = false;
+    size_t running = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (stages[i] == 3)
+        {
+            continue;
+        }
+        running++;
+        pidFds[i] = syscall(SYS_pidfd_open, pids[i], 0);
+        if (pidFds[i] == -1)
+        {
+            fallback = true;
+        }
+    }
+    long long end = -1;
+    if (maxWaitMs >= 0)
+    {
+        end = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count() + maxWaitMs;
+    }
+    while (running > 0)
+    {
+        long long now = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        // escalate the commands past their deadline and find the next one
+        long long nearest = end == -1 ? -1 : max(0LL, end - now);
+        // with --mem-budget the RSS of every child is sampled for its whole
+        // life, so the peak kept for its next launches is not only what
+        // admitJob happened to see
+        if (options.memBudget > 0)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                if (stages[i] != 3)
+                {
+                    notePeakRss(commands[i].tokens[0], readRss(pids[i]));
+                }
+            }
+            nearest = nearest == -1 ? 50 : min(nearest, 50LL);
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            if (stages[i] == 3 || deadlines[i] == 0)
+            {
+                continue;
+            }
+            if (now >= deadlines[i] && stages[i] == 0)
+            {
+                signalCommand(pids[i], SIGTERM);
+                stages[i] = 1;
+                deadlines[i] = now + options.killAfterMs;
+                timedOutCount++;
+                double seconds = chrono::duration<double>(chrono::steady_clock::now() - startTimes[i]).count();
+                // one write, the job pool workers report their commands at the same time
+                ostringstream message;
+                message << "timeout: " << commands[i].tokens[0] << " (pid " << pids[i] << ") ran past its deadline after "
+                        << seconds << " s, sent SIGTERM\n";
+                cerr << message.str() << flush;
+            }
+            else if (now >= deadlines[i] && stages[i] == 1)
+            {
+                signalCommand(pids[i], SIGKILL);
+                stages[i] = 2;
+                deadlines[i] = 0;
+                cerr << "timeout: " + commands[i].tokens[0] + " (pid " + to_string(pids[i]) + ") still running, sent SIGKILL\n"
+                     << flush;
+                continue;
+            }
+            if (deadlines[i] != 0 && (nearest == -1 || deadlines[i] - now < nearest))
+            {
+                nearest = deadlines[i] - now;
+            }
+        }
+
+        vector<pollfd> fds;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (stages[i] != 3 && pidFds[i] != -1)
+            {
+                fds.push_back({pidFds[i], POLLIN, 0});
+            }
+        }
+        int wait = (int)min(nearest, (long long)INT_MAX);
+        if (fallback && (wait == -1 || wait > 10))
+        {
+            wait = 10;
+        }
+        if (poll(fds.data(), fds.size(), wait) == -1 && errno != EINTR)
+        {
+            perror("error waiting for the commands");
+            exit(1);
+        }
+
+        // reap whatever exited, a pidfd is readable once its process is a zombie
+        size_t reaped = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            int status = 0;
+            struct rusage usage;
+            if (stages[i] == 3 || wait4(pids[i], &status, WNOHANG, &usage) <= 0)
+            {
+                continue;
+            }
+            statuses[i] = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            if (stages[i] != 0)
+            {
+                statuses[i] = 124;
+                // the command is gone but what it started may still hold its pipes
+                killpg(pids[i], SIGKILL);
+            }
+            stages[i] = 3;
+            running--;
+            reaped++;
+            if (recordFd != -1)
+            {
+                recordChild(commands[i].tokens[0], startTimes[i], statuses[i]);
+            }
+            if (options.memBudget > 0)
+            {
+                notePeakRss(commands[i].tokens[0], (size_t)usage.ru_maxrss * 1024);
+            }
+            if (pidFds[i] != -1)
+            {
+                close(pidFds[i]);
+                pidFds[i] = -1;
+            }
+        }
+        if (end != -1 && (reaped > 0
+            || chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count() >= end))
+        {
+            break;
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (pidFds[i] != -1)
+        {
+            close(pidFds[i]);
+        }
+    }
+}
+
+
+/**
+ * @brief Appends a number to a --record log in 7 bit groups.
+ *
+ * Every byte holds 7 bits of the number, low bits first, with the high bit set
+ * when more bytes follow, so most numbers of a log take one or two bytes.
+ *
+ * @param out The encoded log.
+ * @param value The number.
+ */
+void appendVarint(string &out, unsigned long long value)
+{
+    while (value >= 0x80)
+    {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+
+/**
+ * @brief Reads a number written by appendVarint.
+ *
+ * @param in The encoded log.
+ * @param loc The position to read at, moved past the number.
+ * @param value Updated with the number.
+ * @return Returns false if the log ends inside the number.
+ */
+bool readVarint(const string &in, size_t &loc, unsigned long long &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (loc >= in.size())
+        {
+            return false;
+        }
+        unsigned char byte = in[loc++];
+        value |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief Encodes a recorded line for the --record log.
+ *
+ * The numbers are varints and every string is its length followed by its bytes:
+ * start, duration, status, cwd, the number of variables and each variable, the
+ * line, the number of children and for each one its name, start, duration and
+ * status.
+ *
+ * @param record The line.
+ * @return The encoded line.
+ */
+string encodeRecordedLine(const recordedLine &record)
+{
+    string out;
+    auto appendString = [&](const string &text)
+    {
+        appendVarint(out, text.size());
+        out += text;
+    };
+    appendVarint(out, record.startNs);
+    appendVarint(out, record.durationNs);
+    appendVarint(out, record.status);
+    appendString(record.cwd);
+    appendVarint(out, record.environment.size());
+    for (size_t i = 0; i < record.environment.size(); i++)
+    {
+        appendString(record.environment[i]);
+    }
+    appendString(record.line);
+    appendVarint(out, record.children.size());
+    for (size_t i = 0; i < record.children.size(); i++)
+    {
+        appendString(record.children[i].name);
+        appendVarint(out, record.children[i].startNs);
+        appendVarint(out, record.children[i].durationNs);
+        appendVarint(out, record.children[i].status);
+    }
+    return out;
+}
+
+
+/**
+ * @brief Decodes a line written by encodeRecordedLine.
+ *
+ * @param in The log.
+ * @param loc The position of the line, moved past it.
+ * @param record Updated with the line.
+ * @return Returns false if the log ends inside the line.
+ */
+bool decodeRecordedLine(const string &in, size_t &loc, recordedLine &record)
+{
+    unsigned long long value;
+    auto readNumber = [&](auto &field)
+    {
+        if (!readVarint(in, loc, value))
+        {
+            return false;
+        }
+        field = value;
+        return true;
+    };
+    auto readString = [&](string &text)
+    {
+        if (!readVarint(in, loc, value) || value > in.size() - loc)
+        {
+            return false;
+        }
+        text = in.substr(loc, value);
+        loc += value;
+        return true;
+    };
+    size_t count = 0;
+    record = recordedLine();
+    if (!readNumber(record.startNs) || !readNumber(record.durationNs) || !readNumber(record.status)
+        || !readString(record.cwd) || !readNumber(count))
+    {
+        return false;
+    }
+    record.environment.resize(min(count, in.size()));
+    for (size_t i = 0; i < record.environment.size(); i++)
+    {
+        if (!readString(record.environment[i]))
+        {
+            return false;
+        }
+    }
+    if (!readString(record.line) || !readNumber(count))
+    {
+        return false;
+    }
+    record.children.resize(min(count, in.size()));
+    for (size_t i = 0; i < record.children.size(); i++)
+    {
+        recordedChild &child = record.children[i];
+        if (!readString(child.name) || !readNumber(child.startNs) || !readNumber(child.durationNs)
+            || !readNumber(child.status))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * @brief Creates the --record log and writes its header.
+ *
+ * The log starts with the 8 bytes "MISHREC1", the lines follow one record each.
+ */
+void openRecord()
+{
+    recordFd = open(options.recordFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (recordFd == -1 || write(recordFd, "MISHREC1", 8) != 8)
+    {
+        perror("unable to open the record file");
+        exit(1);
+    }
+    sessionStart = chrono::steady_clock::now();
+}
+
+
+/**
+ * @brief Starts recording a line.
+ *
+ * Keeps the time, the working directory if it changed since the last line and
+ * the variables set or unset since the last line.
+ *
+ * @param line The line as typed.
+ */
+void beginRecordedLine(string line)
+{
+    currentRecord = recordedLine();
+    currentRecord.line = line;
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != nullptr && recordedCwd != cwd)
+    {
+        recordedCwd = cwd;
+        currentRecord.cwd = cwd;
+    }
+    // the first line logs the whole environment
+    map<string, string> environment;
+    for (char **env = environ; *env != nullptr; env++)
+    {
+        string entry = *env;
+        size_t equals = entry.find('=');
+        if (equals != string::npos)
+        {
+            environment[entry.substr(0, equals)] = entry.substr(equals + 1);
+        }
+    }
+    for (map<string, string>::iterator it = environment.begin(); it != environment.end(); it++)
+    {
+        map<string, string>::iterator old = recordedEnvironment.find(it->first);
+        if (old == recordedEnvironment.end() || old->second != it->second)
+        {
+            currentRecord.environment.push_back(it->first + "=" + it->second);
+        }
+    }
+    for (map<string, string>::iterator it = recordedEnvironment.begin(); it != recordedEnvironment.end(); it++)
+    {
+        if (environment.find(it->first) == environment.end())
+        {
+            currentRecord.environment.push_back(it->first);
+        }
+    }
+    recordedEnvironment = environment;
+    currentRecord.startNs = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sessionStart).count();
+}
+
+
+/**
+ * @brief Finishes recording a line and writes it to the log.
+ *
+ * The line is written with one write so a crash never leaves half a record.
+ *
+ * @param status The exit status of the line.
+ */
+void endRecordedLine(int status)
+{
+    long long now = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sessionStart).count();
+    currentRecord.durationNs = now - currentRecord.startNs;
+    currentRecord.status = status;
+    string record = encodeRecordedLine(currentRecord);
+    if (write(recordFd, record.data(), record.size()) != (ssize_t)record.size())
+    {
+        perror("error writing the record file");
+    }
+}
+
+
+/**
+ * @brief Adds a reaped child to the line being recorded.
+ *
+ * Children are reaped by the threads of parallel and batch-args too, so the
+ * line is updated under recordLock.
+ *
+ * @param name The command.
+ * @param start When the child was forked.
+ * @param status Its exit status.
+ */
+void recordChild(string name, chrono::steady_clock::time_point start, int status)
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    recordedChild child;
+    child.name = name;
+    child.durationNs = chrono::duration_cast<chrono::nanoseconds>(now - start).count();
+    child.status = status;
+    lock_guard<mutex> guard(recordLock);
+    long long lineStart = currentRecord.startNs;
+    child.startNs = max(0LL, (long long)chrono::duration_cast<chrono::nanoseconds>(start - sessionStart).count() - lineStart);
+    currentRecord.children.push_back(child);
+}
+
+
+/**
+ * @brief Takes the recorded child that replaces a command in a replay.
+ *
+ * The first recorded child of the line with the same command name is used, so
+ * children forked in a different order by parallel jobs still get their own
+ * duration.
+ *
+ * @param name The command.
+ * @param durationNs Updated with the recorded duration scaled by --speed.
+ * @param status Updated with the recorded exit status.
+ * @return Returns false if the line has no such child left, it then runs for real.
+ */
+bool takeStub(string name, long long &durationNs, int &status)
+{
+    lock_guard<mutex> guard(recordLock);
+    for (size_t i = 0; i < replayStubs.size(); i++)
+    {
+        if (replayStubs[i].name == name)
+        {
+            durationNs = (long long)(replayStubs[i].durationNs / options.replaySpeed);
+            status = replayStubs[i].status & 0xff;
+            replayStubs.erase(replayStubs.begin() + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief Implements --replay.
+ *
+ * Runs every line of a --record log through processInput at its recorded time,
+ * scaled by --speed, after restoring its working directory and variables. With
+ * --stub-children the children sleep for their recorded duration instead of
+ * running, so what is left of a line's time is the shell's own work. The time
+ * every line took beyond its recorded (scaled) duration is reported on stderr,
+ * with the slowest line and the lines whose status changed.
+ */
+void runReplay()
+{
+    // a replayed session goes on after errors like the prompt does
+    isFile = false;
+    ifstream fin(options.replayFile, ios::binary);
+    if (!fin)
+    {
+        perror("unable to open the replay file");
+        exit(1);
+    }
+    stringstream buffer;
+    buffer << fin.rdbuf();
+    string log = buffer.str();
+    if (log.compare(0, 8, "MISHREC1") != 0)
+    {
+        errno = EINVAL;
+        perror("not a mish record file");
+        exit(1);
+    }
+
+    size_t loc = 8;
+    size_t lineCount = 0;
+    size_t changedStatus = 0;
+    double recordedSeconds = 0;
+    double overheadSeconds = 0;
+    double worstOverhead = 0;
+    string worstLine;
+    recordedLine record;
+    sessionStart = chrono::steady_clock::now();
+    while (loc < log.size())
+    {
+        if (!decodeRecordedLine(log, loc, record))
+        {
+            cerr << "replay: the record file is truncated, stopping" << endl;
+            break;
+        }
+        this_thread::sleep_until(sessionStart + chrono::nanoseconds((long long)(record.startNs / options.replaySpeed)));
+        if (!record.cwd.empty() && chdir(record.cwd.c_str()) != 0)
+        {
+            perror("replay: unable to change to the recorded directory");
+        }
+        for (size_t i = 0; i < record.environment.size(); i++)
+        {
+            size_t equals = record.environment[i].find('=');
+            if (equals == string::npos)
+            {
+                unsetenv(record.environment[i].c_str());
+            }
+            else
+            {
+                setenv(record.environment[i].substr(0, equals).c_str(), record.environment[i].substr(equals + 1).c_str(), 1);
+            }
+        }
+        if (options.stubChildren)
+        {
+            lock_guard<mutex> guard(recordLock);
+            replayStubs = record.children;
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        int status = processInput(record.line);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double expected = record.durationNs / 1e9 / options.replaySpeed;
+        lineCount++;
+        recordedSeconds += record.durationNs / 1e9;
+        overheadSeconds += seconds - expected;
+        if (seconds - expected > worstOverhead || lineCount == 1)
+        {
+            worstOverhead = seconds - expected;
+            worstLine = record.line;
+        }
+        if (status != record.status)
+        {
+            changedStatus++;
+        }
+    }
+    double total = chrono::duration<double>(chrono::steady_clock::now() - sessionStart).count();
+    cerr << "replay: " << lineCount << " lines, recorded " << recordedSeconds << " s, replayed in " << total
+         << " s at speed " << options.replaySpeed << (options.stubChildren ? " with stubbed children" : "") << endl;
+    if (lineCount > 0)
+    {
+        cerr << "replay: time over the recording " << overheadSeconds * 1000 << " ms, "
+             << overheadSeconds * 1e6 / lineCount << " us per line, worst " << worstOverhead * 1000 << " ms for: "
+             << worstLine << endl;
+    }
+    if (changedStatus > 0)
+    {
+        cerr << "replay: " << changedStatus << " lines exited with a different status" << endl;
+    }
+}
+
+
+/**
+ * @brief Starts the <(...) and >(...) commands of a plan.
+ *
+ * Every command gets a pipe and runs through executeCommands on a thread of
+ * its own, so it runs next to the commands of the line. For <(cmd) the stdout
+ * of cmd goes to the pipe and the line reads it, for >(cmd) the line writes to
+ * the pipe and cmd reads it as stdin. The placeholders are replaced by
+ * /dev/fd/N, N being the shell's end of the pipe, which the commands using it
+ * keep across exec. Nothing goes through a file. The $(...) and the <(...) of
+ * a substituted command are handled here, before its thread starts.
+ *
+ * @param plan The plan, its tokens and redirected files are updated in place.
+ * @param stages Gets the threads of the started commands.
+ * @param parentFds Gets the shell's ends of the pipes, closed once the line ran.
+ * @return Returns false if a pipe could not be created or a $(...) failed.
+ */
+bool startProcessSubstitutions(executionPlan &plan, vector<thread> &stages, vector<int> &parentFds)
+{
+    vector<string> paths(plan.processSubstitutions.size());
+    for (size_t n = 0; n < plan.processSubstitutions.size(); n++)
+    {
+        executionPlan inner = plan.processSubstitutions[n];
+        bool readsOutput = plan.processDirections[n] == '<';
+        if (inner.commands.empty() || (!inner.substitutions.empty() && !expandSubstitutions(inner)))
+        {
+            return false;
+        }
+        int temp[2];
+        if (pipe2(temp, O_CLOEXEC) == -1)
+        {
+            perror("error creating a pipe");
+            return false;
+        }
+        int innerFd = readsOutput ? temp[1] : temp[0];
+        int outerFd = readsOutput ? temp[0] : temp[1];
+        parentFds.push_back(outerFd);
+        paths[n] = "/dev/fd/" + to_string(outerFd);
+        for (size_t j = 0; j < inner.commands.size(); j++)
+        {
+            // the end of the pipeline writes to the pipe, its start reads from it
+            if (readsOutput && !inner.commands[j].isPipeStart && inner.commands[j].outputFd == -1)
+            {
+                inner.commands[j].outputFd = innerFd;
+            }
+            if (!readsOutput && !inner.commands[j].isPipeEnd && inner.commands[j].inputFd == -1)
+            {
+                inner.commands[j].inputFd = innerFd;
+            }
+            // the overrides of a function body are per thread, the thread of
+            // the command gets them here
+            if (!readsOutput && !inner.commands[j].isPipeStart && inner.commands[j].outputFd == -1)
+            {
+                inner.commands[j].outputFd = stdoutOverrideFd;
+            }
+            if (readsOutput && !inner.commands[j].isPipeEnd && inner.commands[j].inputFd == -1
+                && !inner.commands[j].redirectedInputFromFile)
+            {
+                inner.commands[j].inputFd = stdinOverrideFd;
+            }
+        }
+        // the commands nested in this one are started by the same thread
+        vector<thread> innerStages;
+        vector<int> innerFds;
+        if (!inner.processSubstitutions.empty() && !startProcessSubstitutions(inner, innerStages, innerFds))
+        {
+            close(innerFd);
+            finishProcessSubstitutions(innerStages, innerFds);
+            return false;
+        }
+        stages.emplace_back([inner, innerFd, innerStages = move(innerStages), innerFds]() mutable
+        {
+            executeCommands(inner.commands);
+            // the other end sees the end of the stream once the children are done
+            close(innerFd);
+            finishProcessSubstitutions(innerStages, innerFds);
+        });
+    }
+
+    // put the paths in the arguments and the redirected files, the descriptors
+    // used are added to inherit
+    size_t first = parentFds.size() - paths.size();
+    auto replacePlaceholders = [&](string &token, vector<int> *inherit)
+    {
+        size_t at;
+        while ((at = token.find("$\x02")) != string::npos)
+        {
+            size_t end = token.find('\x02', at + 2);
+            if (end == string::npos)
+            {
+                break;
+            }
+            size_t index = strtoul(token.c_str() + at + 2, nullptr, 10);
+            token.replace(at, end + 1 - at, paths[index]);
+            if (inherit != nullptr)
+            {
+                inherit->push_back(parentFds[first + index]);
+            }
+        }
+    };
+    for (size_t j = 0; j < plan.commands.size(); j++)
+    {
+        commandsToExecute &command = plan.commands[j];
+        for (size_t k = 0; k < command.tokens.size(); k++)
+        {
+            replacePlaceholders(command.tokens[k], &command.inheritFds);
+        }
+        // the child opens a redirected /dev/fd path before exec, no need to inherit
+        replacePlaceholders(command.redirectOutputFileName, nullptr);
+        replacePlaceholders(command.redirectedInputFileName, nullptr);
+    }
+    return true;
+}
+
+
+/**
+ * @brief Waits for the <(...) and >(...) commands of a line once it ran.
+ *
+ * The shell's ends of the pipes are closed first, so a >(...) command sees the
+ * end of its input and a <(...) command that was not fully read gets SIGPIPE.
+ *
+ * @param stages The threads of the commands.
+ * @param parentFds The shell's ends of the pipes.
+ */
+void finishProcessSubstitutions(vector<thread> &stages, vector<int> &parentFds)
+{
+    for (size_t j = 0; j < parentFds.size(); j++)
+    {
+        close(parentFds[j]);
+    }
+    for (size_t j = 0; j < stages.size(); j++)
+    {
+        stages[j].join();
+    }
+    parentFds.clear();
+    stages.clear();
+}
+
+
+/**
+ * @brief Reads a size like 512M.
+ *
+ * A K, M or G suffix multiplies the number by 1024, 1024^2 or 1024^3.
+ *
+ * @param text The size.
+ * @param bytes Updated with the size in bytes.
+ * @return Returns false if the text is not a positive size.
+ */
+bool parseBytes(string text, size_t &bytes)
+{
+    size_t scale = 1;
+    if (!text.empty() && (text.back() == 'K' || text.back() == 'M' || text.back() == 'G'))
+    {
+        scale = text.back() == 'K' ? 1 << 10 : text.back() == 'M' ? 1 << 20 : 1 << 30;
+        text.pop_back();
+    }
+    size_t count;
+    if (!parseCount(text, count))
+    {
+        return false;
+    }
+    bytes = count * scale;
+    return true;
+}
+
+
+/**
+ * @brief Keeps the highest RSS seen for a command.
+ *
+ * @param name The command.
+ * @param bytes An RSS of one of its runs.
+ */
+void notePeakRss(string name, size_t bytes)
+{
+    lock_guard<mutex> guard(peakLock);
+    size_t &peak = peakRss[name];
+    peak = max(peak, bytes);
+}
+
+
+/**
+ * @brief Gives the highest RSS seen for a command.
+ *
+ * @param name The command.
+ * @return The RSS in bytes, 0 if the command never ran with --mem-budget.
+ */
+size_t knownPeakRss(string name)
+{
+    lock_guard<mutex> guard(peakLock);
+    map<string, size_t>::iterator peak = peakRss.find(name);
+    return peak == peakRss.end() ? 0 : peak->second;
+}
+
+
+/**
+ * @brief Reads the current RSS of a process from /proc/PID/statm.
+ *
+ * @param pid The process.
+ * @return The RSS in bytes, 0 if the process is gone.
+ */
+size_t readRss(int pid)
+{
+    string path = "/proc/" + to_string(pid) + "/statm";
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    char buffer[128];
+    ssize_t count = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (count <= 0)
+    {
+        return 0;
+    }
+    buffer[count] = '\0';
+    // the fields are size, resident, shared... in pages
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    if (sscanf(buffer, "%lu %lu", &size, &resident) != 2)
+    {
+        return 0;
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+
+/**
+ * @brief Holds the next job of a & line until the memory budget has room for it.
+ *
+ * The memory of a running command is the larger of its current RSS, sampled
+ * from /proc every 50 ms, and its estimate. A job's estimate is the sum of the
+ * estimates of its commands: the peak of their earlier runs, or the budget
+ * divided by the number of jobs of the line for a command never seen. The job is
+ * held while the running commands and the estimate go over --mem-budget. The
+ * wait wakes up as soon as a command exits and keeps enforcing the deadlines.
+ * A job is never held when nothing else runs, so a job bigger than the budget
+ * runs alone instead of never. The hold is reported on stderr.
+ *
+ * @param commands The commands of the line.
+ * @param jobStart The first command of the job.
+ * @param estimates The memory every command is expected to use.
+ * @param pids The pid of every command, -1 for the ones not forked.
+ * @param deadlines The deadlines, see waitWithDeadlines.
+ * @param startTimes When every command was forked.
+ * @param stages The state of every command, see waitWithDeadlines.
+ * @param statuses The exit status of every reaped command.
+ */
+void admitJob(vector<commandsToExecute> &commands, size_t jobStart, vector<size_t> &estimates, vector<int> &pids,
+              vector<long long> &deadlines, vector<chrono::steady_clock::time_point> &startTimes, vector<int> &stages,
+              vector<int> &statuses)
+{
+    size_t estimate = 0;
+    for (size_t j = jobStart; j < commands.size() && (j == jobStart || commands[j].isPipeEnd); j++)
+    {
+        estimate += estimates[j];
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool held = false;
+    // projected memory when the job was first held
+    size_t heldAt = 0;
+    while (true)
+    {
+        size_t running = 0;
+        size_t projected = estimate;
+        for (size_t j = 0; j < jobStart; j++)
+        {
+            if (stages[j] == 3)
+            {
+                continue;
+            }
+            running++;
+            size_t rss = readRss(pids[j]);
+            notePeakRss(commands[j].tokens[0], rss);
+            projected += max(rss, estimates[j]);
+        }
+        if (running == 0 || projected <= options.memBudget)
+        {
+            break;
+        }
+        if (!held)
+        {
+            held = true;
+            heldAt = projected;
+        }
+        waitWithDeadlines(commands, pids, deadlines, startTimes, stages, statuses, 50);
+    }
+    if (held)
+    {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cerr << "mem-budget: held " << commands[jobStart].tokens[0] << " for " << seconds << " s, "
+             << heldAt / 1048576.0 << " MiB projected for a budget of " << options.memBudget / 1048576.0 << " MiB" << endl;
+    }
+}
+
+
+/**
+ * @brief Stops the --parse-ahead parser thread and waits for it.
+ *
+ * Registered with atexit, so it also runs when a line exits the shell. It then
+ * runs before the globals the parser reads (the options, the lines completed
+ * in the journal) are destroyed.
+ */
+void stopParser()
+{
+    if (parserThread == nullptr || this_thread::get_id() == parserThread->get_id())
+    {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(parserQueue->lock);
+        parserQueue->stop = true;
+    }
+    parserQueue->changed.notify_all();
+    parserThread->join();
+    parserThread = nullptr;
+    parserQueue = nullptr;
+}
@@ -8,14 +8,39 @@
 #include<unistd.h>
 #include <fstream>
 #include <vector>
+#include <deque>
 #include <cstdlib>
 #include <algorithm>
 #include <climits>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sstream>
+#include <csignal>
+#include <zlib.h>
+#ifdef MISH_ZSTD
+#include <zstd.h>
+#endif
 #include <fcntl.h>
+#include <map>
 using namespace std;
 
+//true when the shell runs a script, errors then end the shell
+extern bool isFile;
+
 
 
 struct commandsToExecute {
@@ -26,15 +51,222 @@ struct commandsToExecute {
     bool isPipeEnd;
     string redirectOutputFileName;
     string redirectedInputFileName;
+    // descriptors the child should use as stdout / stderr instead of the
+    // shell's own, -1 means inherit
+    int outputFd = -1;
+    int errorFd = -1;
+    // descriptor the child should use as stdin, -1 means inherit
+    int inputFd = -1;
+    // "gz" or "zst" when the redirected file is compressed by the shell, empty
+    // when it is used as is
+    string outputCompression;
+    string inputCompression;
+    // milliseconds the command may run, from a timeout prefix, 0 for no limit
+    long long timeoutMs = 0;
+    // close on exec descriptors the command gets as /dev/fd/N arguments
+    vector<int> inheritFds;
+};
+
+// settings given with -- options on the command line
+struct shellOptions {
+    // "line" or "job" to group the output of parallel commands, empty to let
+    // them write directly
+    string groupOutput;
+    // append-only record of the completed lines of a script, empty for none
+    string journalFile;
+    // skip the lines already recorded in the journal
+    bool resume = false;
+    // print the plan of every line before and after optimizing it
+    bool explain = false;
+    // rewrite pipelines to use fewer processes
+    bool optimize = true;
+    // number of script lines parsed ahead of the one running, 0 to parse each
+    // line right before it runs
+    size_t parseAhead = 64;
+    // most bytes a $(...) command may output
+    size_t substitutionLimit = 16 << 20;
+    // milliseconds every command of a line may run, 0 for no limit
+    long long lineTimeoutMs = 0;
+    // milliseconds from SIGTERM to SIGKILL for a command past its deadline
+    long long killAfterMs = 2000;
+    // binary log of the session for --replay, empty for none
+    string recordFile;
+    // log to replay instead of reading commands, empty for none
+    string replayFile;
+    // how many times faster than recorded the replay runs
+    double replaySpeed = 1;
+    // replay the children as sleeps of their recorded duration
+    bool stubChildren = false;
+    // bytes of RSS the jobs of a & line may use together, 0 for no limit
+    size_t memBudget = 0;
+};
+
+// a child forked for a recorded line
+struct recordedChild {
+    string name;
+    // nanoseconds from the start of the line to the fork
+    long long startNs = 0;
+    long long durationNs = 0;
+    int status = 0;
+};
+
+// a line of a --record log
+struct recordedLine {
+    // nanoseconds from the start of the session
+    long long startNs = 0;
+    long long durationNs = 0;
+    int status = 0;
+    // working directory when the line started, empty if it didn't change
+    string cwd;
+    // variables changed since the last line, NAME=VALUE or NAME when unset
+    vector<string> environment;
+    string line;
+    vector<recordedChild> children;
+};
+
+// a parsed line, ready to run
+struct executionPlan {
+    vector<commandsToExecute> commands;
+    // message of the syntax error of the line, reported when the line runs
+    string error;
+    // the line is exit
+    bool isExit = false;
+    // the whole line when it is an on-change command
+    string onChange;
+    // name and parsed body of a function the line defines
+    string functionName;
+    vector<executionPlan> functionBody;
+    // parsed $(...) commands, the tokens hold $\x01N\x01 where the output of
+    // the Nth one goes
+    vector<executionPlan> substitutions;
+    // parsed <(...) and >(...) commands, the tokens hold $\x02N\x02 where the
+    // /dev/fd path of the Nth one goes. processDirections holds < or > for each
+    vector<executionPlan> processSubstitutions;
+    string processDirections;
+    // byte offset and content of the line in the script, for the journal
+    long long offset = 0;
+    string line;
+    // marks the end of the script in a planQueue
+    bool endOfInput = false;
+};
+
+// bounded single producer, single consumer queue of parsed lines. The slots
+// are only written by the producer between tail and head + size and only read
+// by the consumer between head and tail, so no lock is needed for them. lock
+// only pairs with changed, which wakes the side waiting on an empty or full
+// queue when the other side moves head or tail
+struct planQueue {
+    vector<executionPlan> slots;
+    // number of plans taken, only moved by the consumer
+    atomic<size_t> head{0};
+    // number of plans added, only moved by the producer
+    atomic<size_t> tail{0};
+    // set when the shell exits, the producer stops reading
+    atomic<bool> stop{false};
+    mutex lock;
+    condition_variable changed;
+};
+
+// buffered output of one stream of a grouped command
+struct outputRing {
+    vector<char> data;
+    // index of the first buffered byte
+    size_t head = 0;
+    // number of buffered bytes
+    size_t size = 0;
+    // true once the writing end is closed
+    bool finished = false;
+};
+// a file or directory watched by on-change
+struct watchedInput {
+    string path;
+    // directories are watched themselves, files through their directory so
+    // editors that replace the file are noticed too
+    bool isDirectory;
+    // inotify watch descriptor and the name events carry for a file
+    int watch;
+    string name;
+    // hash of the content when the pipeline last ran
+    unsigned long long fingerprint;
 };
+extern shellOptions options;
+bool parseOptions(int argc, char *argv[], string &scriptName);
 void interactive();
-string reduceSpacesAndTrim(string input);
+string reduceSpacesAndTrim(string input, string &error);
 void nonInteractive(string fileName);
 void generateTokens(string input, vector<string> & tokens, string &redirectedFileName , string & redirectedInputFileName);
 int executeCommands(vector<commandsToExecute> commands);
 //int executeCommand(vector<string> tokens, bool outputToFile, string fileName);
-bool isInputOpen(ifstream& fin, string fileName);
+bool openInput(ifstream& fin, string fileName);
 bool isOutputOpen(ofstream& fout, string fileName);
-void processInput(string input);
+int processInput(string input);
+void parseInput(string input, executionPlan &plan);
+int runPlan(executionPlan plan);
+void pushPlan(planQueue &queue, executionPlan plan);
+void stopParser();
+executionPlan popPlan(planQueue &queue);
+bool parseFunctionHeader(string line, string &name, string &rest);
+bool opensFunction(string line);
+string readFunctionBody(istream &in, string firstLine, bool prompt);
+void parseFunction(string name, string rest, executionPlan &plan);
+void expandPositionalToken(string token, vector<string> &expanded);
+void expandPositionalPlan(executionPlan &plan);
+int runFunctionCall(commandsToExecute call);
+int callFunction(vector<string> tokens);
+string extractSubstitutions(string input, executionPlan &plan);
+bool captureOutput(executionPlan inner, string &output);
+bool expandSubstitutionToken(string token, executionPlan &plan, vector<string> &outputs, vector<bool> &done, vector<string> &expanded);
+bool expandSubstitutions(executionPlan &plan);
+bool parseDuration(string text, long long &milliseconds);
+void parseTimeoutPrefix(commandsToExecute &command);
+void signalCommand(int pid, int signal);
+void waitWithDeadlines(vector<commandsToExecute> &commands, vector<int> &pids, vector<long long> &deadlines,
+                       vector<chrono::steady_clock::time_point> &startTimes, vector<int> &stages,
+                       vector<int> &statuses, long long maxWaitMs);
+void appendVarint(string &out, unsigned long long value);
+bool readVarint(const string &in, size_t &loc, unsigned long long &value);
+string encodeRecordedLine(const recordedLine &record);
+bool decodeRecordedLine(const string &in, size_t &loc, recordedLine &record);
+void openRecord();
+void beginRecordedLine(string line);
+void endRecordedLine(int status);
+void recordChild(string name, chrono::steady_clock::time_point start, int status);
+bool takeStub(string name, long long &durationNs, int &status);
+void runReplay();
+bool startProcessSubstitutions(executionPlan &plan, vector<thread> &stages, vector<int> &parentFds);
+void finishProcessSubstitutions(vector<thread> &stages, vector<int> &parentFds);
+bool parseBytes(string text, size_t &bytes);
+void notePeakRss(string name, size_t bytes);
+size_t knownPeakRss(string name);
+size_t readRss(int pid);
+void admitJob(vector<commandsToExecute> &commands, size_t jobStart, vector<size_t> &estimates, vector<int> &pids,
+              vector<long long> &deadlines, vector<chrono::steady_clock::time_point> &startTimes, vector<int> &stages,
+              vector<int> &statuses);
 int executeInbuiltCommands(vector<string> tokens);
-#endif
\ No newline at end of file
+commandsToExecute newCommand(vector<string> tokens);
+size_t availableArgumentSpace();
+void writeCapturedOutput(int captureFd, int target);
+size_t runJobPool(vector<vector<string>> jobs, size_t workerCount, string name, int outputTarget,
+                  commandsToExecute input);
+bool parseCount(string text, size_t &value);
+int runParallel(commandsToExecute command);
+int runBatchArgs(commandsToExecute command);
+void appendToRing(outputRing &ring, const char *bytes, size_t count);
+void writeFromRing(outputRing &ring, size_t count, int target);
+void collectGroupedOutput(vector<int> readFds, size_t jobCount);
+unsigned long long hashLine(string line);
+string encodeField(string field);
+bool decodeField(const string &text, size_t &loc, string &field);
+void openJournal();
+void writeJournalRecord(long long offset, string line, int status);
+string describePlan(vector<commandsToExecute> commands);
+bool parseLineCount(commandsToExecute command, long &count);
+void optimizePipeline(vector<commandsToExecute> &commands);
+unsigned long long fingerprintPath(string path);
+int runOnChange(string input);
+string compressionFormat(string fileName, bool compressed);
+string compressChunk(const string &chunk, string format);
+void compressStream(int inputFd, int outputFd, string format, string fileName);
+void decompressStream(int inputFd, int outputFd, string format, string fileName);
+void reportTransfer(string name, string fileName, size_t from, size_t to, chrono::steady_clock::time_point start);
+#endif
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Regression scripts for mish.
+#
+#     tests/run.sh [path/to/mish] [NAME...]
+#
+# Every tests/NAME.mish runs in a fresh copy of this directory, with the
+# options listed in NAME.args. Its stdout must match NAME.out and its stderr
+# must contain every line of NAME.err, if there is one. The directory of the
+# binary is put first on PATH so a script can start mish itself (--resume,
+# --replay).
+
+binary=${1:-./mish}
+[ $# -gt 0 ] && shift
+if [ ! -x "$binary" ]; then
+    echo "usage: $0 [path/to/mish] [NAME...]" >&2
+    exit 2
+fi
+binary=$(cd "$(dirname "$binary")" && pwd)/$(basename "$binary")
+tests=$(cd "$(dirname "$0")" && pwd)
+if [ $# -eq 0 ]; then
+    set -- $(cd "$tests" && ls *.mish | sed 's/\.mish$//')
+fi
+
+bin=$(mktemp -d)
+ln -s "$binary" "$bin/mish"
+failed=0
+for name in "$@"; do
+    work=$(mktemp -d)
+    cp "$tests"/* "$work"
+    args=$(cat "$tests/$name.args" 2>/dev/null)
+    (cd "$work" && PATH=$bin:$PATH timeout 60 mish $args "$name.mish" > stdout 2> stderr < /dev/null)
+    result=ok
+    if ! cmp -s "$work/stdout" "$tests/$name.out"; then
+        result=FAIL
+        diff "$tests/$name.out" "$work/stdout" | sed 's/^/    /'
+    fi
+    if [ -f "$tests/$name.err" ]; then
+        while IFS= read -r pattern; do
+            if ! grep -qF -- "$pattern" "$work/stderr"; then
+                result=FAIL
+                echo "    stderr is missing: $pattern"
+            fi
+        done < "$tests/$name.err"
+    fi
+    echo "$result $name"
+    [ $result = ok ] || failed=$((failed + 1))
+    rm -rf "$work"
+done
+rm -rf "$bin"
+[ $failed -eq 0 ] || echo "$failed failed"
+[ $failed -eq 0 ]